@@ -2,12 +2,12 @@
 
 IMAGE=image.fat
 SRC=audio
-CODE=sw/idf/examples/turret
+CUES=sw/main/behaviour.def
 
-[ -d $SRC -a -d $CODE ] || exit 1
+[ -d $SRC -a -f $CUES ] || exit 1
 DST=`mktemp -d`
 ( cd $SRC ; find -type d ) | ( cd "$DST" ; xargs mkdir -p )
-( cd $CODE ; git grep -h -o '/audio/.*mp3' | sort -u | sed 's,/audio/,,' ) | xargs -I{} ffmpeg -i $SRC/\{} -ar 22050 -f s8 "$DST/{}.s8"
+python3 sw/tools/cuegen.py --list $CUES | xargs -I{} ffmpeg -i $SRC/\{} -ar 22050 -f s8 "$DST/{}.s8"
 rm -f $IMAGE
 dd if=/dev/zero of=$IMAGE bs=4096 count=$(( 40 + `du -B 4096 -s "$DST" | cut -f 1` * 3 / 2 ))
 /sbin/mkfs.vfat -S 4096 $IMAGE
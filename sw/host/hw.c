@@ -0,0 +1,1002 @@
+#include <errno.h>
+#include <math.h>
+
+#include "sim.h"
+#include "cues.h"
+#include "head.h"
+
+/*
+ * Models of what the firmware drives: the heap, the FAT partition with
+ * the clips of cue_ids.h, NVS, the I2S DMA ring, the ADXL345s on the
+ * I2C bus, the wingspan servos with their end switches, and the gun
+ * and laser pins. Driver calls take about the time they take on the
+ * device, in virtual time.
+ */
+
+/* Free after boot on the device, less the IDF and WiFi-less drivers */
+#define SIM_HEAP_SIZE		(160 * 1024)
+
+#define SIM_GPIO_N		40
+/* A gun pulse after this long without one starts an engagement */
+#define SIM_ENGAGEMENT_GAP_US	1000000
+
+/*
+ * Servo travel in duty us * ms from the stop, from closed to open. The
+ * slowest unit closes in the 2.5 s the close timeout allows, and all
+ * reach the stop within the fixed opening time.
+ */
+#define SIM_SERVO_STOP		1500
+#define SIM_SERVO_DEADBAND	20
+#define SIM_SERVO_TRAVEL	160000
+#define SIM_SWITCH_TRAVEL	3000
+
+#define SIM_ADXL345_ID		0xe5
+#define SIM_ADXL345_G		210
+#define SIM_ADXL345_NOISE	2	/* peak, LSB */
+
+/* The record partition of partitions-record.csv */
+#define SIM_RECORD_SUBTYPE	0x40
+#define SIM_RECORD_SIZE		0x40000
+
+#define SIM_FILES		32
+#define SIM_CLIP_RATE		22050
+
+/* Driver costs on the device, us */
+#define SIM_I2C_BYTE_US		23	/* 9 bits at 400 kHz */
+#define SIM_I2C_CALL_US		60
+#define SIM_FOPEN_US		2000	/* FAT directory lookup */
+#define SIM_FSEEK_US		50
+#define SIM_FREAD_US		100
+#define SIM_FREAD_KB_US		120
+#define SIM_NVS_COMMIT_US	5000
+#define SIM_FLASH_ERASE_US	45000	/* a sector */
+#define SIM_FLASH_WRITE_US	600	/* a 256 byte page */
+#define SIM_MOUNT_US		300000
+
+struct sim_wing {
+	uint32_t duty;
+	int64_t last_us;
+	double pos;
+	double speed;	/* of this unit, relative */
+};
+
+struct sim_adxl345 {
+	uint8_t addr;
+	int g[3];
+	int tilt;	/* added to x, from sim_tilt() */
+	bool stream;
+	int64_t fifo_us;
+};
+
+struct sim_file {
+	bool open;
+	int clip;
+	long pos;
+	long size;
+};
+
+struct sim_i2s {
+	bool installed;
+	bool running;
+	unsigned gen;
+	QueueHandle_t queue;
+	int bufs;
+	int buf_len;		/* frames */
+	size_t buf_bytes;
+	int free;		/* played out, for the writer to take */
+	size_t cur;		/* bytes left in the buffer being written */
+	int channels;
+	int rate;
+	int64_t start_us;
+	uint64_t eofs;
+};
+
+struct sim_nvs_entry {
+	char key[16];
+	uint8_t data[64];
+	size_t len;
+};
+
+struct sim_timer {
+	esp_timer_cb_t callback;
+	void *arg;
+	uint64_t period;
+};
+
+struct sim_hw {
+	size_t heap_free;
+	uint32_t level[SIM_GPIO_N];
+	int64_t last_shot_us;
+	struct sim_wing wing[HEADS];
+	struct sim_adxl345 adxl345[HEADS];
+	struct sim_file file[SIM_FILES];
+	bool mounted;
+	int max_files;
+	unsigned files;
+	int fopen_fail_permille;
+	struct sim_i2s i2s;
+	struct sim_nvs_entry nvs[16];
+	uint8_t record[SIM_RECORD_SIZE];
+	unsigned rand_seed;
+};
+
+static struct sim_hw hw;
+
+static void sim_heap_init(void);
+
+void sim_hw_init(int fopen_fail_permille)
+{
+	int i;
+
+	hw.fopen_fail_permille = fopen_fail_permille;
+	sim_heap_init();
+	memset(hw.record, 0xff, sizeof(hw.record));
+	for (i = 0; i < HEADS; ++i) {
+		struct sim_adxl345 *a = hw.adxl345 + i;
+		int x = (int)(sim_rand32() % 41) - 20;
+		int y = (int)(sim_rand32() % 41) - 20;
+
+		/* Units differ in speed and in how level they stand */
+		hw.wing[i].speed = 0.8 + (sim_rand32() % 401) / 1000.0;
+		a->addr = head_config[i].accel_addr;
+		a->g[0] = x;
+		a->g[1] = y;
+		a->g[2] = -(int)sqrt(SIM_ADXL345_G * SIM_ADXL345_G - x * x - y * y);
+	}
+}
+
+/* Power went away mid-move, the wings stay wherever they were */
+void sim_power_cut(void)
+{
+	int i;
+
+	for (i = 0; i < HEADS; ++i)
+		hw.wing[i].pos = sim_rand32() % (SIM_SERVO_TRAVEL + 1);
+}
+
+const char *esp_err_to_name(esp_err_t err)
+{
+	switch (err) {
+	case ESP_OK:
+		return "ESP_OK";
+	case ESP_FAIL:
+		return "ESP_FAIL";
+	case ESP_ERR_NO_MEM:
+		return "ESP_ERR_NO_MEM";
+	case ESP_ERR_INVALID_ARG:
+		return "ESP_ERR_INVALID_ARG";
+	case ESP_ERR_INVALID_STATE:
+		return "ESP_ERR_INVALID_STATE";
+	case ESP_ERR_NOT_FOUND:
+		return "ESP_ERR_NOT_FOUND";
+	case ESP_ERR_TIMEOUT:
+		return "ESP_ERR_TIMEOUT";
+	case ESP_ERR_NVS_NOT_FOUND:
+		return "ESP_ERR_NVS_NOT_FOUND";
+	default:
+		return "ERROR";
+	}
+}
+
+uint32_t esp_random(void)
+{
+	return sim_rand32();
+}
+
+int64_t esp_timer_get_time(void)
+{
+	sim_cpu();
+	return sim_now();
+}
+
+/*
+ * Heap, first fit over one arena like the IDF 4.4 multi_heap, so that
+ * the largest free block shows fragmentation. Every block starts with
+ * its size and the size of the block before it, free neighbours merge.
+ * Task stacks, queues and DMA buffers take their blocks here too.
+ */
+
+#define SIM_BLOCK_USED		1u
+#define SIM_BLOCK_MIN		(2 * sizeof(struct sim_block))
+
+struct sim_block {
+	uint32_t size;		/* with the header, SIM_BLOCK_USED */
+	uint32_t prev;		/* size of the block before, 0 -- first */
+};
+
+static uint8_t sim_arena[SIM_HEAP_SIZE] __attribute__((aligned(8)));
+
+static struct sim_block *sim_block_at(size_t offset)
+{
+	return offset < SIM_HEAP_SIZE ?
+		(struct sim_block *)(sim_arena + offset) : NULL;
+}
+
+static size_t sim_block_size(const struct sim_block *b)
+{
+	return b->size & ~SIM_BLOCK_USED;
+}
+
+static struct sim_block *sim_block_next(struct sim_block *b)
+{
+	return sim_block_at((uint8_t *)b - sim_arena + sim_block_size(b));
+}
+
+static void sim_heap_init(void)
+{
+	struct sim_block *b = sim_block_at(0);
+
+	*b = (struct sim_block){ .size = SIM_HEAP_SIZE };
+	hw.heap_free = SIM_HEAP_SIZE - sizeof(*b);
+	sim_stat.heap_min_free = hw.heap_free;
+}
+
+/* Sets the size of b and tells the block after it */
+static void sim_block_resize(struct sim_block *b, size_t size, bool used)
+{
+	struct sim_block *next;
+
+	b->size = size | (used ? SIM_BLOCK_USED : 0);
+	next = sim_block_next(b);
+	if (next)
+		next->prev = size;
+}
+
+void *sim_malloc(size_t size)
+{
+	size_t need = (sizeof(struct sim_block) + size + 7) & ~(size_t)7;
+	struct sim_block *b;
+
+	if (need < SIM_BLOCK_MIN)
+		need = SIM_BLOCK_MIN;
+	for (b = sim_block_at(0); b; b = sim_block_next(b)) {
+		size_t have = sim_block_size(b);
+
+		if (b->size & SIM_BLOCK_USED || have < need)
+			continue;
+		if (have - need >= SIM_BLOCK_MIN) {
+			sim_block_resize(b, need, true);
+			sim_block_resize(sim_block_next(b), have - need, false);
+			hw.heap_free -= need;
+		} else {
+			sim_block_resize(b, have, true);
+			hw.heap_free -= have - sizeof(*b);
+		}
+		if (hw.heap_free < sim_stat.heap_min_free)
+			sim_stat.heap_min_free = hw.heap_free;
+		return b + 1;
+	}
+	return NULL;
+}
+
+void *sim_calloc(size_t n, size_t size)
+{
+	void *p = sim_malloc(n * size);
+
+	if (p)
+		memset(p, 0, n * size);
+	return p;
+}
+
+void sim_free(void *p)
+{
+	struct sim_block *b = (struct sim_block *)p - 1;
+	struct sim_block *next;
+	size_t size;
+
+	if (!p)
+		return;
+	if ((uint8_t *)p < sim_arena || (uint8_t *)p >= sim_arena + SIM_HEAP_SIZE ||
+	    !(b->size & SIM_BLOCK_USED))
+		sim_fail("bad free %p", p);
+	size = sim_block_size(b);
+	hw.heap_free += size - sizeof(*b);
+	next = sim_block_next(b);
+	if (next && !(next->size & SIM_BLOCK_USED)) {
+		size += next->size;
+		hw.heap_free += sizeof(*next);
+	}
+	if (b->prev) {
+		struct sim_block *prev = (struct sim_block *)((uint8_t *)b - b->prev);
+
+		if (!(prev->size & SIM_BLOCK_USED)) {
+			size += prev->size;
+			hw.heap_free += sizeof(*b);
+			b = prev;
+		}
+	}
+	sim_block_resize(b, size, false);
+}
+
+size_t heap_caps_get_free_size(uint32_t caps)
+{
+	return hw.heap_free;
+}
+
+size_t heap_caps_get_minimum_free_size(uint32_t caps)
+{
+	return sim_stat.heap_min_free;
+}
+
+size_t heap_caps_get_largest_free_block(uint32_t caps)
+{
+	struct sim_block *b;
+	size_t largest = 0;
+
+	for (b = sim_block_at(0); b; b = sim_block_next(b))
+		if (!(b->size & SIM_BLOCK_USED) &&
+		    sim_block_size(b) - sizeof(*b) > largest)
+			largest = sim_block_size(b) - sizeof(*b);
+	return largest;
+}
+
+/* C library, seeded by the simulation */
+
+void sim_srand(unsigned seed)
+{
+	hw.rand_seed = seed;
+}
+
+int sim_rand(void)
+{
+	hw.rand_seed = hw.rand_seed * 1103515245 + 12345;
+	return (hw.rand_seed >> 1) & 0x7fffffff;
+}
+
+/* esp_timer, callbacks run from the scheduler */
+
+static void sim_timer_fire(void *arg)
+{
+	struct sim_timer *t = arg;
+
+	t->callback(t->arg);
+	sim_event(sim_now() + t->period, sim_timer_fire, t);
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *args,
+			   esp_timer_handle_t *handle)
+{
+	struct sim_timer *t = calloc(1, sizeof(*t));
+
+	t->callback = args->callback;
+	t->arg = args->arg;
+	*handle = (esp_timer_handle_t)t;
+	return ESP_OK;
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period)
+{
+	struct sim_timer *t = (struct sim_timer *)timer;
+
+	t->period = period;
+	sim_event(sim_now() + period, sim_timer_fire, t);
+	return ESP_OK;
+}
+
+/* Two runs took the same course if they changed the same outputs */
+static void sim_output(int what, uint32_t value)
+{
+	uint64_t v[3] = { sim_now(), what, value };
+	const uint8_t *p = (const uint8_t *)v;
+	size_t i;
+
+	for (i = 0; i < sizeof(v); ++i)
+		sim_stat.outputs = (sim_stat.outputs ^ p[i]) * 0x100000001b3ULL;
+}
+
+/* Wingspan servos and end switches */
+
+static int sim_head_of_pin(gpio_num_t pin, size_t offset)
+{
+	int i;
+
+	for (i = 0; i < HEADS; ++i)
+		if (*(const gpio_num_t *)((const char *)(head_config + i) +
+					  offset) == pin)
+			return i;
+	return -1;
+}
+
+#define SIM_HEAD_OF(pin, field) \
+	sim_head_of_pin(pin, offsetof(struct head_config, field))
+
+/* A continuous rotation servo, speed ~ |duty - stop| past a deadband */
+static void sim_wing_move(struct sim_wing *w)
+{
+	int64_t now = sim_now();
+	int d = w->duty ? SIM_SERVO_STOP - (int)w->duty : 0;
+
+	if (d > SIM_SERVO_DEADBAND && w->pos >= SIM_SERVO_TRAVEL)
+		sim_stat.wings_stall_us += now - w->last_us;
+	if (abs(d) > SIM_SERVO_DEADBAND)
+		w->pos += d * w->speed * (now - w->last_us) / 1000.0;
+	if (w->pos < 0)
+		w->pos = 0;
+	else if (w->pos > SIM_SERVO_TRAVEL)
+		w->pos = SIM_SERVO_TRAVEL;
+	w->last_us = now;
+}
+
+esp_err_t mcpwm_gpio_init(mcpwm_unit_t unit, mcpwm_io_signals_t signal,
+			  int pin)
+{
+	return ESP_OK;
+}
+
+esp_err_t mcpwm_init(mcpwm_unit_t unit, mcpwm_timer_t timer,
+		     const mcpwm_config_t *config)
+{
+	return ESP_OK;
+}
+
+esp_err_t mcpwm_set_duty_in_us(mcpwm_unit_t unit, mcpwm_timer_t timer,
+			       mcpwm_generator_t gen, uint32_t us)
+{
+	int i;
+
+	sim_output(SIM_GPIO_N + unit * 2 + timer, us);
+	if (timer != MCPWM_TIMER_0)
+		return ESP_OK;
+	for (i = 0; i < HEADS; ++i) {
+		if (head_config[i].pwm != unit)
+			continue;
+		sim_wing_move(hw.wing + i);
+		if (hw.wing[i].duty != us)
+			sim_log('D', "sim", "head %d wingspan %" PRIu32 " us at %.0f",
+				i, us, hw.wing[i].pos);
+		/* An opening ends by cutting its duty, a close by the stop duty */
+		if (!us && hw.wing[i].duty &&
+		    hw.wing[i].duty < SIM_SERVO_STOP - SIM_SERVO_DEADBAND) {
+			++sim_stat.wings_opened;
+			if (hw.wing[i].pos < SIM_SERVO_TRAVEL)
+				++sim_stat.wings_short;
+		}
+		hw.wing[i].duty = us;
+	}
+	return ESP_OK;
+}
+
+/* GPIO */
+
+esp_err_t gpio_config(const gpio_config_t *config)
+{
+	return ESP_OK;
+}
+
+/* The end switch pulls low while the wings are closed */
+int gpio_get_level(gpio_num_t pin)
+{
+	int head = SIM_HEAD_OF(pin, end_switch);
+
+	if (pin < 0 || pin >= SIM_GPIO_N)
+		sim_fail("gpio %d", pin);
+	if (head >= 0) {
+		sim_wing_move(hw.wing + head);
+		return hw.wing[head].pos >= SIM_SWITCH_TRAVEL;
+	}
+	return hw.level[pin];
+}
+
+esp_err_t gpio_set_level(gpio_num_t pin, uint32_t level)
+{
+	if (pin < 0 || pin >= SIM_GPIO_N)
+		sim_fail("gpio %d", pin);
+	if (level && !hw.level[pin] &&
+	    (SIM_HEAD_OF(pin, lguns) >= 0 || SIM_HEAD_OF(pin, rguns) >= 0)) {
+		if (!sim_stat.shots ||
+		    sim_now() - hw.last_shot_us > SIM_ENGAGEMENT_GAP_US)
+			++sim_stat.engagements;
+		hw.last_shot_us = sim_now();
+		++sim_stat.shots;
+	}
+	if (level != hw.level[pin])
+		sim_output(pin, level);
+	hw.level[pin] = level;
+	return ESP_OK;
+}
+
+/* ADXL345s, resting at a tilt with a little noise */
+
+esp_err_t i2c_param_config(i2c_port_t port, const i2c_config_t *config)
+{
+	return ESP_OK;
+}
+
+esp_err_t i2c_driver_install(i2c_port_t port, i2c_mode_t mode,
+			     size_t rx_buf, size_t tx_buf, int flags)
+{
+	return ESP_OK;
+}
+
+static struct sim_adxl345 *sim_adxl345(uint8_t addr, size_t bytes)
+{
+	int i;
+
+	sim_spend(SIM_I2C_CALL_US + bytes * SIM_I2C_BYTE_US);
+	for (i = 0; i < HEADS; ++i)
+		if (hw.adxl345[i].addr == addr)
+			return hw.adxl345 + i;
+	return NULL;
+}
+
+static int16_t sim_adxl345_axis(const struct sim_adxl345 *a, int axis)
+{
+	return a->g[axis] + (axis ? 0 : a->tilt) +
+		(int)(sim_rand32() % (2 * SIM_ADXL345_NOISE + 1)) -
+		SIM_ADXL345_NOISE;
+}
+
+/* Picks a head up or tips it over, in LSB */
+void sim_tilt(int head, int x)
+{
+	hw.adxl345[head].tilt = x;
+}
+
+esp_err_t i2c_master_write_read_device(i2c_port_t port, uint8_t addr,
+				       const uint8_t *write, size_t write_size,
+				       uint8_t *read, size_t read_size,
+				       TickType_t ticks)
+{
+	struct sim_adxl345 *a = sim_adxl345(addr, 2 + write_size + read_size);
+	int64_t n;
+	int i;
+
+	if (!a)
+		return ESP_FAIL;
+	memset(read, 0, read_size);
+	switch (write[0]) {
+	case 0x00:
+		read[0] = SIM_ADXL345_ID;
+		break;
+	case 0x32:
+		for (i = 0; i < 3 && 2 * i + 1 < read_size; ++i) {
+			int16_t v = sim_adxl345_axis(a, i);
+
+			read[2 * i] = v;
+			read[2 * i + 1] = v >> 8;
+		}
+		if (a->stream && a->fifo_us < sim_now() - 320000)
+			a->fifo_us = sim_now() - 320000;
+		a->fifo_us += 10000;
+		break;
+	case 0x39:
+		/* 100 Hz samples since the oldest one left, up to 32 */
+		n = a->stream ? (sim_now() - a->fifo_us) / 10000 : 0;
+		read[0] = n < 0 ? 0 : n > 32 ? 32 : n;
+		break;
+	}
+	return ESP_OK;
+}
+
+esp_err_t i2c_master_write_to_device(i2c_port_t port, uint8_t addr,
+				     const uint8_t *write, size_t write_size,
+				     TickType_t ticks)
+{
+	struct sim_adxl345 *a = sim_adxl345(addr, 1 + write_size);
+
+	if (!a)
+		return ESP_FAIL;
+	if (write_size == 2 && write[0] == 0x38) {
+		a->stream = write[1] & 0x80;
+		a->fifo_us = sim_now();
+	}
+	return ESP_OK;
+}
+
+/*
+ * I2S DMA ring as the legacy driver runs it: every buffer played out
+ * goes to a queue of free ones for the writer, one short of all of
+ * them. When that queue is full the DMA is replaying stale data, which
+ * is reported as TX queue overflow.
+ */
+
+static void sim_i2s_post(i2s_event_type_t type)
+{
+	i2s_event_t event = { .type = type, .size = hw.i2s.buf_bytes };
+	i2s_event_t dropped;
+
+	if (!hw.i2s.queue)
+		return;
+	if (!sim_queue_post(hw.i2s.queue, &event)) {
+		xQueueReceive(hw.i2s.queue, &dropped, 0);
+		sim_queue_post(hw.i2s.queue, &event);
+	}
+}
+
+static int64_t sim_i2s_eof_us(uint64_t n)
+{
+	return hw.i2s.start_us + n * hw.i2s.buf_len * 1000000 / hw.i2s.rate;
+}
+
+static void sim_i2s_eof(void *arg)
+{
+	struct sim_i2s *i2s = &hw.i2s;
+
+	if (!i2s->running || (uintptr_t)arg != i2s->gen)
+		return;
+	if (i2s->free == i2s->bufs - 1) {
+		++sim_stat.i2s_underruns;
+		sim_i2s_post(I2S_EVENT_TX_Q_OVF);
+	} else {
+		++i2s->free;
+		sim_wake(i2s);
+	}
+	sim_i2s_post(I2S_EVENT_TX_DONE);
+	sim_event(sim_i2s_eof_us(++i2s->eofs), sim_i2s_eof,
+		  (void *)(uintptr_t)i2s->gen);
+}
+
+esp_err_t i2s_driver_install(i2s_port_t port, const i2s_config_t *config,
+			     int queue_size, void *queue)
+{
+	struct sim_i2s *i2s = &hw.i2s;
+
+	if (i2s->installed)
+		return ESP_ERR_INVALID_STATE;
+	i2s->installed = true;
+	i2s->bufs = config->dma_buf_count;
+	i2s->buf_len = config->dma_buf_len;
+	i2s->rate = config->sample_rate;
+	i2s->channels = config->channel_format < I2S_CHANNEL_FMT_ONLY_RIGHT ?
+		2 : 1;
+	i2s->buf_bytes = i2s->buf_len * i2s->channels *
+		config->bits_per_sample / 8;
+	if (!sim_malloc(i2s->bufs * i2s->buf_bytes))
+		return ESP_ERR_NO_MEM;
+	if (queue) {
+		i2s->queue = xQueueCreate(queue_size, sizeof(i2s_event_t));
+		*(QueueHandle_t *)queue = i2s->queue;
+	}
+	/* The driver starts right away */
+	return i2s_start(port);
+}
+
+esp_err_t i2s_set_dac_mode(i2s_dac_mode_t mode)
+{
+	return ESP_OK;
+}
+
+esp_err_t i2s_set_clk(i2s_port_t port, uint32_t rate, uint32_t bits,
+		      uint32_t channels)
+{
+	struct sim_i2s *i2s = &hw.i2s;
+
+	i2s->rate = rate;
+	i2s->channels = channels;
+	i2s->buf_bytes = i2s->buf_len * channels * bits / 8;
+	return ESP_OK;
+}
+
+esp_err_t i2s_start(i2s_port_t port)
+{
+	struct sim_i2s *i2s = &hw.i2s;
+
+	i2s->running = true;
+	++i2s->gen;
+	i2s->start_us = sim_now();
+	i2s->eofs = 1;
+	sim_event(sim_i2s_eof_us(1), sim_i2s_eof, (void *)(uintptr_t)i2s->gen);
+	return ESP_OK;
+}
+
+esp_err_t i2s_stop(i2s_port_t port)
+{
+	hw.i2s.running = false;
+	return ESP_OK;
+}
+
+esp_err_t i2s_write_expand(i2s_port_t port, const void *src, size_t size,
+			   size_t src_bits, size_t aim_bits, size_t *written,
+			   TickType_t ticks)
+{
+	struct sim_i2s *i2s = &hw.i2s;
+	size_t bytes = size * aim_bits / src_bits;
+	int64_t wake_us = sim_deadline(ticks);
+
+	*written = 0;
+	while (bytes) {
+		size_t n;
+
+		if (!i2s->cur) {
+			while (!i2s->free) {
+				if (!i2s->running && wake_us < 0)
+					sim_fail("i2s write while stopped");
+				if (!sim_wait(i2s, wake_us))
+					return ESP_ERR_TIMEOUT;
+			}
+			--i2s->free;
+			i2s->cur = i2s->buf_bytes;
+		}
+		n = bytes < i2s->cur ? bytes : i2s->cur;
+		i2s->cur -= n;
+		bytes -= n;
+		*written += n * src_bits / aim_bits;
+	}
+	return ESP_OK;
+}
+
+/* FAT on the raw flash partition, the clips are generated */
+
+esp_err_t esp_vfs_fat_rawflash_mount(const char *base, const char *label,
+				     const esp_vfs_fat_mount_config_t *config)
+{
+	sim_spend(SIM_MOUNT_US);
+	hw.max_files = config->max_files;
+	hw.mounted = true;
+	return ESP_OK;
+}
+
+FILE *sim_fopen(const char *path, const char *mode)
+{
+	int i, clip = -1;
+
+	sim_spend(SIM_FOPEN_US);
+	for (i = 0; i < CLIP_N; ++i)
+		if (!strcmp(cue_clip[i].path, path))
+			clip = i;
+	if (!hw.mounted || clip < 0) {
+		errno = ENOENT;
+		return NULL;
+	}
+	if (hw.files >= hw.max_files) {
+		++sim_stat.fopen_refused;
+		errno = ENFILE;
+		return NULL;
+	}
+	if (sim_rand32() % 1000 < hw.fopen_fail_permille) {
+		++sim_stat.fopen_injected;
+		errno = EIO;
+		return NULL;
+	}
+	for (i = 0; i < SIM_FILES; ++i) {
+		struct sim_file *f = hw.file + i;
+
+		if (f->open)
+			continue;
+		*f = (struct sim_file){
+			.open = true,
+			.clip = clip,
+			.size = (long)cue_clip[clip].ms * SIM_CLIP_RATE / 1000,
+		};
+		if (++hw.files > sim_stat.files_max)
+			sim_stat.files_max = hw.files;
+		return (FILE *)f;
+	}
+	sim_fail("out of files");
+}
+
+static struct sim_file *sim_file(FILE *file)
+{
+	struct sim_file *f = (struct sim_file *)file;
+
+	if (f < hw.file || f >= hw.file + SIM_FILES || !f->open)
+		sim_fail("bad FILE %p", (void *)file);
+	return f;
+}
+
+/* Signed 8-bit samples that are never a silent period */
+size_t sim_fread(void *buf, size_t size, size_t n, FILE *file)
+{
+	struct sim_file *f = sim_file(file);
+	size_t bytes = size * n;
+	int8_t *p = buf;
+	size_t i;
+
+	sim_spend(SIM_FREAD_US + bytes * SIM_FREAD_KB_US / 1024);
+	if (bytes > f->size - f->pos)
+		bytes = f->size - f->pos;
+	for (i = 0; i < bytes; ++i)
+		p[i] = ((f->pos + i) * 7 + f->clip * 13) % 64 - 32;
+	f->pos += bytes;
+	return size ? bytes / size : 0;
+}
+
+int sim_fseek(FILE *file, long offset, int whence)
+{
+	struct sim_file *f = sim_file(file);
+
+	sim_spend(SIM_FSEEK_US);
+	switch (whence) {
+	case SEEK_SET:
+		break;
+	case SEEK_CUR:
+		offset += f->pos;
+		break;
+	case SEEK_END:
+		offset += f->size;
+		break;
+	}
+	if (offset < 0)
+		return -1;
+	f->pos = offset;
+	return 0;
+}
+
+long sim_ftell(FILE *file)
+{
+	return sim_file(file)->pos;
+}
+
+int sim_fclose(FILE *file)
+{
+	sim_file(file)->open = false;
+	--hw.files;
+	return 0;
+}
+
+/* NVS, committed values survive only the run */
+
+esp_err_t nvs_flash_init(void)
+{
+	return ESP_OK;
+}
+
+esp_err_t nvs_flash_erase(void)
+{
+	memset(hw.nvs, 0, sizeof(hw.nvs));
+	return ESP_OK;
+}
+
+esp_err_t nvs_open(const char *name, nvs_open_mode_t mode,
+		   nvs_handle_t *handle)
+{
+	*handle = 1;
+	return ESP_OK;
+}
+
+static struct sim_nvs_entry *sim_nvs(const char *key, bool create)
+{
+	struct sim_nvs_entry *free = NULL;
+	int i;
+
+	for (i = 0; i < 16; ++i) {
+		struct sim_nvs_entry *e = hw.nvs + i;
+
+		if (!strcmp(e->key, key))
+			return e;
+		if (!free && !e->key[0])
+			free = e;
+	}
+	if (!create || !free || strlen(key) >= sizeof(free->key))
+		return NULL;
+	strcpy(free->key, key);
+	return free;
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *out,
+		       size_t *len)
+{
+	struct sim_nvs_entry *e = sim_nvs(key, false);
+
+	if (!e)
+		return ESP_ERR_NVS_NOT_FOUND;
+	if (!out) {
+		*len = e->len;
+		return ESP_OK;
+	}
+	if (*len < e->len)
+		return ESP_ERR_NVS_INVALID_LENGTH;
+	memcpy(out, e->data, e->len);
+	*len = e->len;
+	return ESP_OK;
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key,
+		       const void *value, size_t len)
+{
+	struct sim_nvs_entry *e = sim_nvs(key, true);
+
+	if (!e || len > sizeof(e->data))
+		return ESP_ERR_INVALID_ARG;
+	memcpy(e->data, value, len);
+	e->len = len;
+	return ESP_OK;
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle)
+{
+	sim_spend(SIM_NVS_COMMIT_US);
+	++sim_stat.nvs_commits;
+	return ESP_OK;
+}
+
+void nvs_close(nvs_handle_t handle)
+{
+}
+
+/* Flash partitions, only the record partition is raw */
+
+static const esp_partition_t sim_record_partition = {
+	.type = ESP_PARTITION_TYPE_DATA,
+	.subtype = SIM_RECORD_SUBTYPE,
+	.address = 0x3c0000,
+	.size = SIM_RECORD_SIZE,
+	.label = "record",
+};
+
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type,
+						esp_partition_subtype_t subtype,
+						const char *label)
+{
+	const esp_partition_t *p = &sim_record_partition;
+
+	if (type != p->type || subtype != p->subtype ||
+	    (label && strcmp(label, p->label)))
+		return NULL;
+	return p;
+}
+
+static bool sim_flash_range(const esp_partition_t *partition,
+			    size_t offset, size_t size)
+{
+	return partition == &sim_record_partition &&
+		offset <= SIM_RECORD_SIZE && size <= SIM_RECORD_SIZE - offset;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *partition,
+			     size_t offset, void *dst, size_t size)
+{
+	if (!sim_flash_range(partition, offset, size))
+		return ESP_ERR_INVALID_ARG;
+	memcpy(dst, hw.record + offset, size);
+	return ESP_OK;
+}
+
+/* Writes can only clear bits, like on NOR flash */
+esp_err_t esp_partition_write(const esp_partition_t *partition,
+			      size_t offset, const void *src, size_t size)
+{
+	const uint8_t *p = src;
+	size_t i;
+
+	if (!sim_flash_range(partition, offset, size))
+		return ESP_ERR_INVALID_ARG;
+	sim_spend((size + 255) / 256 * SIM_FLASH_WRITE_US);
+	for (i = 0; i < size; ++i)
+		hw.record[offset + i] &= p[i];
+	return ESP_OK;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *partition,
+				    size_t offset, size_t size)
+{
+	if (!sim_flash_range(partition, offset, size) ||
+	    offset % SPI_FLASH_SEC_SIZE || size % SPI_FLASH_SEC_SIZE)
+		return ESP_ERR_INVALID_ARG;
+	sim_spend(size / SPI_FLASH_SEC_SIZE * SIM_FLASH_ERASE_US);
+	memset(hw.record + offset, 0xff, size);
+	return ESP_OK;
+}
+
+bool sim_flash_load(const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	bool ok;
+
+	if (!f)
+		return false;
+	ok = fread(hw.record, 1, sizeof(hw.record), f) == sizeof(hw.record);
+	fclose(f);
+	return ok;
+}
+
+bool sim_flash_save(const char *path)
+{
+	FILE *f = fopen(path, "wb");
+	bool ok;
+
+	if (!f)
+		return false;
+	ok = fwrite(hw.record, 1, sizeof(hw.record), f) == sizeof(hw.record);
+	return !fclose(f) && ok;
+}
+
+/*
+ * RTC_NOINIT memory survives a restart. At time 0 nothing else ran
+ * yet, so the boot that follows is the restarted one.
+ */
+void esp_restart(void)
+{
+	if (sim_now())
+		sim_fail("esp_restart() after boot");
+}
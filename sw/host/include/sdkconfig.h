@@ -0,0 +1,26 @@
+#ifndef SDKCONFIG_H
+#define SDKCONFIG_H
+
+/*
+ * The options of sdkconfig.defaults the host build needs, with the
+ * soak on and the console off. Build with e.g. make HEADS=2 or
+ * make CFLAGS_EXTRA=-DCONFIG_TURRET_AUDIO_MONO to try others.
+ */
+
+#define CONFIG_FREERTOS_HZ			100
+#define CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ	160
+
+#define CONFIG_TURRET_CONTROL_CORE		0
+#define CONFIG_TURRET_AUDIO_CORE		1
+#ifndef CONFIG_TURRET_HEADS
+#define CONFIG_TURRET_HEADS			1
+#endif
+#define CONFIG_TURRET_PREFETCH_SLOTS		10
+
+#define CONFIG_TURRET_LATENCY_BENCH		1
+#ifndef CONFIG_TURRET_LATENCY_BENCH_RUNS
+#define CONFIG_TURRET_LATENCY_BENCH_RUNS	100
+#endif
+#define CONFIG_TURRET_SOAK			1
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef REDIRECT_H
+#define REDIRECT_H
+
+/*
+ * Forced into every firmware source. The heap counts against the
+ * ESP32 heap size, files come from the clips in cue_ids.h and random
+ * numbers from the seeded simulation, so that runs repeat.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+void *sim_malloc(size_t size);
+void *sim_calloc(size_t n, size_t size);
+void sim_free(void *p);
+FILE *sim_fopen(const char *path, const char *mode);
+size_t sim_fread(void *buf, size_t size, size_t n, FILE *file);
+int sim_fseek(FILE *file, long offset, int whence);
+long sim_ftell(FILE *file);
+int sim_fclose(FILE *file);
+void sim_srand(unsigned seed);
+int sim_rand(void);
+
+#define malloc(size)			sim_malloc(size)
+#define calloc(n, size)			sim_calloc(n, size)
+#define free(p)				sim_free(p)
+#define fopen(path, mode)		sim_fopen(path, mode)
+#define fread(buf, size, n, file)	sim_fread(buf, size, n, file)
+#define fseek(file, offset, whence)	sim_fseek(file, offset, whence)
+#define ftell(file)			sim_ftell(file)
+#define fclose(file)			sim_fclose(file)
+#define srand(seed)			sim_srand(seed)
+#define rand()				sim_rand()
+#define random()			sim_rand()
+
+#endif
@@ -0,0 +1,86 @@
+#include <getopt.h>
+
+#include "sim.h"
+#include "record.h"
+
+/*
+ * Replay a session recorded by soak -r, or dumped from a unit, through
+ * the firmware: record_replay() restarts into it, app_main boots and
+ * the recorded inputs stand in for the sensors in every control tick
+ * until the session ends. A replay of an image takes the same course
+ * every time, the output hash tells.
+ */
+
+#define REPLAY_POLL_US		(1000 * 1000LL)
+#define REPLAY_START_US		(10 * REPLAY_POLL_US)
+/* Longer than the ring of the record partition holds */
+#define REPLAY_MAX_US		(24 * 3600 * 1000000LL)
+
+esp_err_t app_main(void);
+
+static int session;
+static bool started;
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: replay [-v] <image> <session>\n"
+		"  image    the record partition, from soak -r or read off a unit\n"
+		"  session  1 -- the newest, 2 -- the one before, ...\n"
+		"  -v       more logs, twice for debug\n");
+	exit(2);
+}
+
+static void watch(void *arg)
+{
+	if (record_replaying())
+		started = true;
+	else if (started)
+		sim_stop("replay done");
+	else if (sim_now() > REPLAY_START_US)
+		sim_fail("session %d did not start", session);
+	sim_event(sim_now() + REPLAY_POLL_US, watch, NULL);
+}
+
+static void main_task(void *arg)
+{
+	record_replay(session);
+	app_main();
+}
+
+int main(int argc, char **argv)
+{
+	int c;
+
+	while ((c = getopt(argc, argv, "v")) != -1) {
+		switch (c) {
+		case 'v':
+			++sim_verbose;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind + 2 != argc)
+		usage();
+	session = atoi(argv[optind + 1]);
+	if (session < 1)
+		usage();
+
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	sim_seed(1);
+	sim_hw_init(0);
+	if (!sim_flash_load(argv[optind])) {
+		fprintf(stderr, "cannot read %s\n", argv[optind]);
+		return 1;
+	}
+	sim_event(REPLAY_POLL_US, watch, NULL);
+	sim_run(main_task, REPLAY_MAX_US, "");
+	printf("virtual %.2f h replayed\n", sim_now() / 3600e6);
+	printf("engagements: %" PRIu64 ", %" PRIu64 " shots\n",
+	       sim_stat.engagements, sim_stat.shots);
+	printf("outputs: %016" PRIx64 "\n", sim_stat.outputs);
+	if (sim_verbose)
+		sim_dump();
+	return 0;
+}
@@ -0,0 +1,621 @@
+#define _GNU_SOURCE
+#include <stdarg.h>
+#include <ucontext.h>
+
+#include "sim.h"
+
+/*
+ * All tasks run as coroutines of one thread. The highest priority
+ * ready task runs until it blocks, ties in the order they became
+ * ready. Time passes in sim_spend() and for the firmware code a task
+ * runs, counted in basic blocks by -fsanitize-coverage=trace-pc and
+ * charged before it next blocks or reads the clock. When no task is
+ * ready the clock jumps to the next timeout or event. A run with the
+ * same seed takes the same course.
+ */
+
+#define SIM_TASKS		16
+#define SIM_EVENTS		16
+#define SIM_STACK_SIZE		(256 * 1024)
+#define SIM_TICK_US		(1000000 / configTICK_RATE_HZ)
+/* Task switches without the clock moving before a task is declared stuck */
+#define SIM_SPIN_MAX		1000000
+/* Xtensa cycles for one basic block of firmware code, a few instructions */
+#define SIM_BLOCK_CYCLES	6
+#define SIM_CPU_MHZ		CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ
+
+struct sim_task {
+	ucontext_t ctx;
+	void *stack;
+	void *heap;		/* the device stack, in the device heap */
+	TaskFunction_t fn;
+	void *arg;
+	const char *name;
+	UBaseType_t priority;
+	uint32_t stack_size;
+	enum {
+		SIM_TASK_FREE,
+		SIM_TASK_READY,
+		SIM_TASK_BLOCKED,
+		SIM_TASK_EXITED,
+	} state;
+	const void *wait;	/* object blocked on, NULL -- time only */
+	int64_t wake_us;	/* -1 -- no timeout */
+	bool timed_out;
+	uint64_t ready_seq;
+	uint32_t notify;
+	uint64_t blocks;	/* charged so far */
+};
+
+struct sim_queue {
+	unsigned length;
+	unsigned size;
+	unsigned count;
+	unsigned head;
+	uint8_t *items;
+};
+
+struct sim_events {
+	EventBits_t bits;
+};
+
+struct sim_event {
+	bool used;
+	int64_t us;
+	uint64_t seq;
+	void (*fn)(void *arg);
+	void *arg;
+};
+
+struct sim_struct {
+	int64_t now;
+	ucontext_t ctx;
+	struct sim_task task[SIM_TASKS];
+	struct sim_task *current;
+	uint64_t seq;
+	struct sim_event event[SIM_EVENTS];
+	const char *stop;
+	uint64_t rand;
+	unsigned spin;
+	uint64_t blocks;	/* run by the current task, not charged yet */
+	uint64_t cycles;	/* charged short of a whole us */
+};
+
+static struct sim_struct sim;
+/* Name of the task whose exit ends the run */
+static const char *sim_watch = "";
+
+struct sim_stat sim_stat;
+int sim_verbose;
+
+int64_t sim_now(void)
+{
+	return sim.now;
+}
+
+void sim_fail(const char *fmt, ...)
+{
+	va_list ap;
+
+	fflush(stdout);
+	fprintf(stderr, "[%12.6f] FAIL: ", sim.now / 1e6);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+void sim_log(char level, const char *tag, const char *fmt, ...)
+{
+	va_list ap;
+
+	switch (level) {
+	case 'E':
+	case 'W':
+		break;
+	case 'I':
+		if (sim_verbose || !strncmp(tag, "latency", 7) ||
+		    !strncmp(tag, "boot", 4))
+			break;
+		return;
+	default:
+		if (sim_verbose > 1)
+			break;
+		return;
+	}
+	printf("[%12.6f] %c %s: ", sim.now / 1e6, level, tag);
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	printf("\n");
+}
+
+/* xorshift64* */
+uint32_t sim_rand32(void)
+{
+	sim.rand ^= sim.rand >> 12;
+	sim.rand ^= sim.rand << 25;
+	sim.rand ^= sim.rand >> 27;
+	return (sim.rand * 0x2545f4914f6cdd1dULL) >> 32;
+}
+
+void sim_seed(uint64_t seed)
+{
+	sim.rand = seed * 0x9e3779b97f4a7c15ULL + 1;
+}
+
+void sim_stop(const char *why)
+{
+	sim.stop = why;
+}
+
+void sim_event(int64_t us, void (*fn)(void *arg), void *arg)
+{
+	int i;
+
+	for (i = 0; i < SIM_EVENTS; ++i) {
+		struct sim_event *e = sim.event + i;
+
+		if (e->used)
+			continue;
+		*e = (struct sim_event){
+			.used = true,
+			.us = us < sim.now ? sim.now : us,
+			.seq = ++sim.seq,
+			.fn = fn,
+			.arg = arg,
+		};
+		return;
+	}
+	sim_fail("out of events");
+}
+
+static void sim_ready(struct sim_task *t)
+{
+	t->state = SIM_TASK_READY;
+	t->wait = NULL;
+	t->ready_seq = ++sim.seq;
+}
+
+/* ticks from now on the tick boundaries, -1 -- forever */
+int64_t sim_deadline(TickType_t ticks)
+{
+	if (ticks == portMAX_DELAY)
+		return -1;
+	return (sim.now / SIM_TICK_US + ticks) * SIM_TICK_US;
+}
+
+/* Every basic block of the firmware calls this */
+void __sanitizer_cov_trace_pc(void)
+{
+	++sim.blocks;
+}
+
+static void sim_block(struct sim_task *t, const void *obj, int64_t wake_us)
+{
+	t->state = SIM_TASK_BLOCKED;
+	t->wait = obj;
+	t->wake_us = wake_us;
+	t->timed_out = false;
+	swapcontext(&t->ctx, &sim.ctx);
+}
+
+/* Returns whether the clock moved */
+static bool sim_cpu_charge(struct sim_task *t)
+{
+	uint64_t cycles = sim.blocks * SIM_BLOCK_CYCLES + sim.cycles;
+	int64_t us = cycles / SIM_CPU_MHZ;
+
+	t->blocks += sim.blocks;
+	sim.blocks = 0;
+	sim.cycles = cycles % SIM_CPU_MHZ;
+	if (!us)
+		return false;
+	sim_block(t, NULL, sim.now + us);
+	return true;
+}
+
+/* Basic blocks of firmware the running task ran so far */
+uint64_t sim_blocks(void)
+{
+	return sim.current ? sim.current->blocks + sim.blocks : 0;
+}
+
+/* The running task takes the CPU time of the code it ran so far */
+void sim_cpu(void)
+{
+	if (sim.current)
+		sim_cpu_charge(sim.current);
+}
+
+/*
+ * Returns false on timeout. After the CPU time of the caller is
+ * charged, waits on an object return true early, callers check their
+ * condition again.
+ */
+bool sim_wait(const void *obj, int64_t wake_us)
+{
+	struct sim_task *t = sim.current;
+
+	if (!t)
+		sim_fail("blocking outside of a task");
+	if (sim_cpu_charge(t) && obj)
+		return true;
+	if (wake_us >= 0 && wake_us <= sim.now)
+		return false;
+	sim_block(t, obj, wake_us);
+	return !t->timed_out;
+}
+
+void sim_wake(const void *obj)
+{
+	int i;
+
+	for (i = 0; i < SIM_TASKS; ++i) {
+		struct sim_task *t = sim.task + i;
+
+		if (t->state == SIM_TASK_BLOCKED && t->wait == obj)
+			sim_ready(t);
+	}
+}
+
+void sim_spend(int64_t us)
+{
+	if (us > 0)
+		sim_wait(NULL, sim.now + us);
+}
+
+static struct sim_task *sim_self(void)
+{
+	if (!sim.current)
+		sim_fail("no task context");
+	return sim.current;
+}
+
+static void sim_exit(struct sim_task *t)
+{
+	if (!strcmp(t->name, sim_watch))
+		sim_stop("watched task exited");
+	t->state = SIM_TASK_EXITED;
+	if (t == sim.current)
+		swapcontext(&t->ctx, &sim.ctx);
+}
+
+static void sim_trampoline(void)
+{
+	struct sim_task *t = sim.current;
+
+	t->fn(t->arg);
+	/* Only app_main may return, the IDF deletes its task */
+	if (strcmp(t->name, "main"))
+		sim_fail("%s returned", t->name);
+	sim_exit(t);
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name,
+				   uint32_t stack, void *arg,
+				   UBaseType_t priority, TaskHandle_t *handle,
+				   BaseType_t core)
+{
+	struct sim_task *t = NULL;
+	int i;
+
+	for (i = 0; i < SIM_TASKS && !t; ++i)
+		if (sim.task[i].state == SIM_TASK_FREE)
+			t = sim.task + i;
+	if (!t)
+		return pdFAIL;
+
+	/* The stack comes out of the device heap */
+	*t = (struct sim_task){
+		.heap = sim_malloc(stack),
+		.fn = fn,
+		.arg = arg,
+		.name = name,
+		.priority = priority,
+		.stack_size = stack,
+	};
+	if (!t->heap)
+		return pdFAIL;
+	t->stack = malloc(SIM_STACK_SIZE);
+	getcontext(&t->ctx);
+	t->ctx.uc_stack.ss_sp = t->stack;
+	t->ctx.uc_stack.ss_size = SIM_STACK_SIZE;
+	t->ctx.uc_link = NULL;
+	makecontext(&t->ctx, sim_trampoline, 0);
+	sim_ready(t);
+	if (handle)
+		*handle = t;
+	return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+	sim_exit(task ? task : sim_self());
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+	sim_wait(NULL, sim_deadline(ticks ? ticks : 1));
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+	return sim.now / SIM_TICK_US;
+}
+
+/* Host stacks are large, report the device stack as unused */
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task)
+{
+	return (task ? task : sim_self())->stack_size;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+	++task->notify;
+	sim_wake(&task->notify);
+	return pdPASS;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks)
+{
+	struct sim_task *t = sim_self();
+	int64_t wake_us = sim_deadline(ticks);
+	uint32_t n;
+
+	while (!t->notify && ticks && sim_wait(&t->notify, wake_us))
+		;
+	n = t->notify;
+	if (clear)
+		t->notify = 0;
+	else if (n)
+		--t->notify;
+	return n;
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t size)
+{
+	struct sim_queue *q = sim_calloc(1, sizeof(*q) + length * size);
+
+	if (!q)
+		return NULL;
+	q->length = length;
+	q->size = size;
+	q->items = (uint8_t *)(q + 1);
+	return q;
+}
+
+/* From an interrupt, never blocks */
+bool sim_queue_post(QueueHandle_t q, const void *item)
+{
+	if (q->count == q->length)
+		return false;
+	if (q->size)
+		memcpy(q->items + (q->head + q->count) % q->length * q->size,
+		       item, q->size);
+	++q->count;
+	sim_wake(q);
+	return true;
+}
+
+BaseType_t xQueueSend(QueueHandle_t q, const void *item, TickType_t ticks)
+{
+	int64_t wake_us = sim_deadline(ticks);
+
+	while (q->count == q->length)
+		if (!ticks || !sim_wait(q, wake_us))
+			return pdFALSE;
+	return sim_queue_post(q, item) ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t q, void *item, TickType_t ticks)
+{
+	int64_t wake_us = sim_deadline(ticks);
+
+	while (!q->count)
+		if (!ticks || !sim_wait(q, wake_us))
+			return pdFALSE;
+	if (q->size)
+		memcpy(item, q->items + q->head * q->size, q->size);
+	q->head = (q->head + 1) % q->length;
+	--q->count;
+	sim_wake(q);
+	return pdTRUE;
+}
+
+BaseType_t xQueueReset(QueueHandle_t q)
+{
+	q->count = 0;
+	q->head = 0;
+	sim_wake(q);
+	return pdPASS;
+}
+
+/* A mutex is a queue of one empty item, full while it is free */
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+	struct sim_queue *q = xQueueCreate(1, 0);
+
+	if (q)
+		q->count = 1;
+	return q;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks)
+{
+	return xQueueReceive(sem, NULL, ticks);
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+{
+	return xQueueSend(sem, NULL, 0);
+}
+
+EventGroupHandle_t xEventGroupCreate(void)
+{
+	return sim_calloc(1, sizeof(struct sim_events));
+}
+
+EventBits_t xEventGroupSetBits(EventGroupHandle_t group, EventBits_t bits)
+{
+	group->bits |= bits;
+	sim_wake(group);
+	return group->bits;
+}
+
+EventBits_t xEventGroupGetBits(EventGroupHandle_t group)
+{
+	return group->bits;
+}
+
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t group, EventBits_t bits,
+				BaseType_t clear, BaseType_t all,
+				TickType_t ticks)
+{
+	int64_t wake_us = sim_deadline(ticks);
+
+	for (;;) {
+		EventBits_t set = group->bits;
+
+		if (all ? (set & bits) == bits : set & bits) {
+			if (clear)
+				group->bits &= ~bits;
+			return set;
+		}
+		if (!ticks || !sim_wait(group, wake_us))
+			return set;
+	}
+}
+
+/* Where the tasks are, for a run that went wrong */
+void sim_dump(void)
+{
+	static const char * const state[] = {
+		"free", "ready", "blocked", "exited",
+	};
+	int i;
+
+	for (i = 0; i < SIM_TASKS; ++i) {
+		const struct sim_task *t = sim.task + i;
+
+		if (t->state == SIM_TASK_FREE)
+			continue;
+		printf("%-16s %2u %-8s wait %p until %.6f\n", t->name,
+		       t->priority, state[t->state], t->wait,
+		       t->wake_us / 1e6);
+	}
+}
+
+static struct sim_task *sim_next_task(void)
+{
+	struct sim_task *best = NULL;
+	int i;
+
+	for (i = 0; i < SIM_TASKS; ++i) {
+		struct sim_task *t = sim.task + i;
+
+		if (t->state != SIM_TASK_READY)
+			continue;
+		if (!best || t->priority > best->priority ||
+		    (t->priority == best->priority &&
+		     t->ready_seq < best->ready_seq))
+			best = t;
+	}
+	return best;
+}
+
+/* Earliest timeout or event, -1 -- none */
+static int64_t sim_next_time(void)
+{
+	int64_t next = -1;
+	int i;
+
+	for (i = 0; i < SIM_TASKS; ++i) {
+		struct sim_task *t = sim.task + i;
+
+		if (t->state == SIM_TASK_BLOCKED && t->wake_us >= 0 &&
+		    (next < 0 || t->wake_us < next))
+			next = t->wake_us;
+	}
+	for (i = 0; i < SIM_EVENTS; ++i)
+		if (sim.event[i].used && (next < 0 || sim.event[i].us < next))
+			next = sim.event[i].us;
+	return next;
+}
+
+/* Run the events due, in the order they were scheduled, then time out tasks */
+static void sim_advance(int64_t us)
+{
+	int i;
+
+	sim.now = us;
+	for (;;) {
+		struct sim_event *due = NULL;
+
+		for (i = 0; i < SIM_EVENTS; ++i) {
+			struct sim_event *e = sim.event + i;
+
+			if (e->used && e->us <= us &&
+			    (!due || e->seq < due->seq))
+				due = e;
+		}
+		if (!due)
+			break;
+		due->used = false;
+		due->fn(due->arg);
+	}
+	for (i = 0; i < SIM_TASKS; ++i) {
+		struct sim_task *t = sim.task + i;
+
+		if (t->state == SIM_TASK_BLOCKED && t->wake_us >= 0 &&
+		    t->wake_us <= us) {
+			t->timed_out = true;
+			sim_ready(t);
+		}
+	}
+}
+
+/*
+ * Runs main_fn as app_main until the virtual time reaches until_us or
+ * a task named watch exits. Returns false in the latter case.
+ */
+bool sim_run(void (*main_fn)(void *arg), int64_t until_us, const char *watch)
+{
+	sim_watch = watch;
+	if (xTaskCreatePinnedToCore(main_fn, "main", 3584, NULL, 1, NULL,
+				    0) != pdPASS)
+		sim_fail("cannot create the main task");
+
+	while (!sim.stop) {
+		struct sim_task *t = sim_next_task();
+		int64_t next;
+
+		if (t) {
+			if (++sim.spin > SIM_SPIN_MAX)
+				sim_fail("%s never blocks", t->name);
+			/* Firmware run from events is not charged */
+			sim.blocks = 0;
+			sim.current = t;
+			swapcontext(&sim.ctx, &t->ctx);
+			sim.current = NULL;
+			if (t->state == SIM_TASK_EXITED) {
+				free(t->stack);
+				t->stack = NULL;
+				sim_free(t->heap);
+				t->heap = NULL;
+			}
+			continue;
+		}
+		next = sim_next_time();
+		if (next < 0)
+			sim_fail("all tasks blocked forever");
+		if (next > until_us) {
+			sim.now = until_us;
+			return true;
+		}
+		sim.spin = 0;
+		sim_advance(next);
+	}
+	return false;
+}
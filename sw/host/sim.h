@@ -0,0 +1,444 @@
+#ifndef SIM_H
+#define SIM_H
+
+/*
+ * The ESP-IDF and FreeRTOS surfaces the firmware uses, backed by a
+ * cooperative scheduler on a virtual clock and models of the turret
+ * hardware. Every header under include/ resolves here.
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sdkconfig.h"
+
+/* esp_err.h */
+typedef int esp_err_t;
+
+#define ESP_OK				0
+#define ESP_FAIL			(-1)
+#define ESP_ERR_NO_MEM			0x101
+#define ESP_ERR_INVALID_ARG		0x102
+#define ESP_ERR_INVALID_STATE		0x103
+#define ESP_ERR_INVALID_SIZE		0x104
+#define ESP_ERR_NOT_FOUND		0x105
+#define ESP_ERR_TIMEOUT			0x107
+#define ESP_ERR_NVS_NOT_FOUND		0x1102
+#define ESP_ERR_NVS_INVALID_LENGTH	0x110c
+#define ESP_ERR_NVS_NO_FREE_PAGES	0x110d
+#define ESP_ERR_NVS_NEW_VERSION_FOUND	0x1110
+
+const char *esp_err_to_name(esp_err_t err);
+
+#define ESP_ERROR_CHECK(x) do {						\
+		esp_err_t err_ = (x);					\
+		if (err_ != ESP_OK)					\
+			sim_fail("%s:%d: %s failed: %s", __FILE__,	\
+				 __LINE__, #x, esp_err_to_name(err_));	\
+	} while (0)
+
+/* esp_log.h */
+#define ESP_LOGE(tag, fmt, ...)	sim_log('E', tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGW(tag, fmt, ...)	sim_log('W', tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGI(tag, fmt, ...)	sim_log('I', tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGD(tag, fmt, ...)	sim_log('D', tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGV(tag, fmt, ...)	sim_log('V', tag, fmt, ##__VA_ARGS__)
+
+/* esp_attr.h */
+#define IRAM_ATTR
+#define DRAM_ATTR
+#define RTC_NOINIT_ATTR
+
+/* esp_random.h, esp_timer.h */
+uint32_t esp_random(void);
+int64_t esp_timer_get_time(void);
+
+typedef struct esp_timer *esp_timer_handle_t;
+typedef void (*esp_timer_cb_t)(void *arg);
+
+typedef enum {
+	ESP_TIMER_TASK,
+} esp_timer_dispatch_t;
+
+typedef struct {
+	esp_timer_cb_t callback;
+	void *arg;
+	esp_timer_dispatch_t dispatch_method;
+	const char *name;
+	bool skip_unhandled_events;
+} esp_timer_create_args_t;
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *args,
+			   esp_timer_handle_t *handle);
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period);
+
+/* esp_heap_caps.h */
+#define MALLOC_CAP_8BIT			(1 << 2)
+#define MALLOC_CAP_DMA			(1 << 3)
+#define MALLOC_CAP_INTERNAL		(1 << 11)
+
+size_t heap_caps_get_free_size(uint32_t caps);
+size_t heap_caps_get_minimum_free_size(uint32_t caps);
+size_t heap_caps_get_largest_free_block(uint32_t caps);
+
+/* freertos/FreeRTOS.h */
+typedef int BaseType_t;
+typedef unsigned UBaseType_t;
+typedef uint32_t TickType_t;
+typedef uint32_t EventBits_t;
+typedef struct sim_task *TaskHandle_t;
+typedef struct sim_queue *QueueHandle_t;
+typedef struct sim_queue *SemaphoreHandle_t;
+typedef struct sim_events *EventGroupHandle_t;
+typedef void (*TaskFunction_t)(void *arg);
+
+#define pdFALSE				0
+#define pdTRUE				1
+#define pdFAIL				0
+#define pdPASS				1
+#define portMAX_DELAY			((TickType_t)0xffffffff)
+#define configTICK_RATE_HZ		CONFIG_FREERTOS_HZ
+#define portTICK_PERIOD_MS		(1000 / configTICK_RATE_HZ)
+#define portTICK_RATE_MS		portTICK_PERIOD_MS
+#define pdMS_TO_TICKS(ms) \
+	((TickType_t)((uint64_t)(ms) * configTICK_RATE_HZ / 1000))
+#define tskNO_AFFINITY			0x7fffffff
+
+/* One thread runs all tasks, critical sections have nothing to exclude */
+typedef struct {
+	int owner;
+} portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED	{ 0 }
+#define portENTER_CRITICAL(mux)		((void)(mux))
+#define portEXIT_CRITICAL(mux)		((void)(mux))
+
+/* freertos/task.h */
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name,
+				   uint32_t stack, void *arg,
+				   UBaseType_t priority, TaskHandle_t *handle,
+				   BaseType_t core);
+void vTaskDelete(TaskHandle_t task);
+void vTaskDelay(TickType_t ticks);
+TickType_t xTaskGetTickCount(void);
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task);
+BaseType_t xTaskNotifyGive(TaskHandle_t task);
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks);
+
+/* freertos/queue.h, freertos/semphr.h */
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t size);
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks);
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticks);
+BaseType_t xQueueReset(QueueHandle_t queue);
+SemaphoreHandle_t xSemaphoreCreateMutex(void);
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem);
+
+/* freertos/event_groups.h */
+EventGroupHandle_t xEventGroupCreate(void);
+EventBits_t xEventGroupSetBits(EventGroupHandle_t group, EventBits_t bits);
+EventBits_t xEventGroupGetBits(EventGroupHandle_t group);
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t group, EventBits_t bits,
+				BaseType_t clear, BaseType_t all,
+				TickType_t ticks);
+
+/* driver/gpio.h */
+typedef int gpio_num_t;
+
+typedef enum {
+	GPIO_INTR_DISABLE,
+	GPIO_INTR_POSEDGE,
+	GPIO_INTR_NEGEDGE,
+	GPIO_INTR_ANYEDGE,
+	GPIO_INTR_LOW_LEVEL,
+	GPIO_INTR_HIGH_LEVEL,
+} gpio_int_type_t;
+
+typedef enum {
+	GPIO_MODE_DISABLE,
+	GPIO_MODE_INPUT,
+	GPIO_MODE_OUTPUT,
+} gpio_mode_t;
+
+typedef enum {
+	GPIO_PULLUP_DISABLE,
+	GPIO_PULLUP_ENABLE,
+} gpio_pullup_t;
+
+typedef enum {
+	GPIO_PULLDOWN_DISABLE,
+	GPIO_PULLDOWN_ENABLE,
+} gpio_pulldown_t;
+
+typedef struct {
+	uint64_t pin_bit_mask;
+	gpio_mode_t mode;
+	gpio_pullup_t pull_up_en;
+	gpio_pulldown_t pull_down_en;
+	gpio_int_type_t intr_type;
+} gpio_config_t;
+
+esp_err_t gpio_config(const gpio_config_t *config);
+int gpio_get_level(gpio_num_t pin);
+esp_err_t gpio_set_level(gpio_num_t pin, uint32_t level);
+
+/* driver/i2c.h */
+typedef int i2c_port_t;
+
+typedef enum {
+	I2C_MODE_SLAVE,
+	I2C_MODE_MASTER,
+} i2c_mode_t;
+
+typedef struct {
+	i2c_mode_t mode;
+	int sda_io_num;
+	int scl_io_num;
+	bool sda_pullup_en;
+	bool scl_pullup_en;
+	struct {
+		uint32_t clk_speed;
+	} master;
+} i2c_config_t;
+
+esp_err_t i2c_param_config(i2c_port_t port, const i2c_config_t *config);
+esp_err_t i2c_driver_install(i2c_port_t port, i2c_mode_t mode,
+			     size_t rx_buf, size_t tx_buf, int flags);
+esp_err_t i2c_master_write_read_device(i2c_port_t port, uint8_t addr,
+				       const uint8_t *write, size_t write_size,
+				       uint8_t *read, size_t read_size,
+				       TickType_t ticks);
+esp_err_t i2c_master_write_to_device(i2c_port_t port, uint8_t addr,
+				     const uint8_t *write, size_t write_size,
+				     TickType_t ticks);
+
+/* driver/i2s.h */
+typedef int i2s_port_t;
+
+#define I2S_MODE_MASTER			(1 << 0)
+#define I2S_MODE_TX			(1 << 2)
+#define I2S_MODE_DAC_BUILT_IN		(1 << 4)
+#define I2S_COMM_FORMAT_STAND_MSB	0x03
+
+typedef enum {
+	I2S_CHANNEL_FMT_RIGHT_LEFT,
+	I2S_CHANNEL_FMT_ALL_RIGHT,
+	I2S_CHANNEL_FMT_ALL_LEFT,
+	I2S_CHANNEL_FMT_ONLY_RIGHT,
+	I2S_CHANNEL_FMT_ONLY_LEFT,
+} i2s_channel_fmt_t;
+
+typedef enum {
+	I2S_DAC_CHANNEL_DISABLE,
+	I2S_DAC_CHANNEL_RIGHT_EN,
+	I2S_DAC_CHANNEL_LEFT_EN,
+	I2S_DAC_CHANNEL_BOTH_EN,
+} i2s_dac_mode_t;
+
+typedef struct {
+	int mode;
+	int sample_rate;
+	int bits_per_sample;
+	i2s_channel_fmt_t channel_format;
+	int communication_format;
+	int intr_alloc_flags;
+	int dma_buf_count;
+	int dma_buf_len;
+	bool use_apll;
+	bool tx_desc_auto_clear;
+} i2s_config_t;
+
+typedef enum {
+	I2S_EVENT_DMA_ERROR,
+	I2S_EVENT_TX_DONE,
+	I2S_EVENT_RX_DONE,
+	I2S_EVENT_TX_Q_OVF,
+	I2S_EVENT_RX_Q_OVF,
+} i2s_event_type_t;
+
+typedef struct {
+	i2s_event_type_t type;
+	size_t size;
+} i2s_event_t;
+
+esp_err_t i2s_driver_install(i2s_port_t port, const i2s_config_t *config,
+			     int queue_size, void *queue);
+esp_err_t i2s_set_dac_mode(i2s_dac_mode_t mode);
+esp_err_t i2s_set_clk(i2s_port_t port, uint32_t rate, uint32_t bits,
+		      uint32_t channels);
+esp_err_t i2s_start(i2s_port_t port);
+esp_err_t i2s_stop(i2s_port_t port);
+esp_err_t i2s_write_expand(i2s_port_t port, const void *src, size_t size,
+			   size_t src_bits, size_t aim_bits, size_t *written,
+			   TickType_t ticks);
+
+/* driver/mcpwm.h */
+typedef enum {
+	MCPWM_UNIT_0,
+	MCPWM_UNIT_1,
+} mcpwm_unit_t;
+
+typedef enum {
+	MCPWM_TIMER_0,
+	MCPWM_TIMER_1,
+	MCPWM_TIMER_2,
+} mcpwm_timer_t;
+
+typedef enum {
+	MCPWM0A,
+	MCPWM0B,
+	MCPWM1A,
+	MCPWM1B,
+} mcpwm_io_signals_t;
+
+typedef enum {
+	MCPWM_OPR_A,
+	MCPWM_OPR_B,
+} mcpwm_generator_t;
+
+typedef enum {
+	MCPWM_UP_COUNTER = 1,
+} mcpwm_counter_type_t;
+
+typedef enum {
+	MCPWM_DUTY_MODE_0,
+} mcpwm_duty_type_t;
+
+typedef struct {
+	uint32_t frequency;
+	float cmpr_a;
+	float cmpr_b;
+	mcpwm_duty_type_t duty_mode;
+	mcpwm_counter_type_t counter_mode;
+} mcpwm_config_t;
+
+esp_err_t mcpwm_gpio_init(mcpwm_unit_t unit, mcpwm_io_signals_t signal,
+			  int pin);
+esp_err_t mcpwm_init(mcpwm_unit_t unit, mcpwm_timer_t timer,
+		     const mcpwm_config_t *config);
+esp_err_t mcpwm_set_duty_in_us(mcpwm_unit_t unit, mcpwm_timer_t timer,
+			       mcpwm_generator_t gen, uint32_t us);
+
+/* esp_vfs_fat.h */
+typedef struct {
+	bool format_if_mount_failed;
+	int max_files;
+	size_t allocation_unit_size;
+} esp_vfs_fat_mount_config_t;
+
+esp_err_t esp_vfs_fat_rawflash_mount(const char *base, const char *label,
+				     const esp_vfs_fat_mount_config_t *config);
+
+/* nvs.h, nvs_flash.h */
+typedef uint32_t nvs_handle_t;
+
+typedef enum {
+	NVS_READONLY,
+	NVS_READWRITE,
+} nvs_open_mode_t;
+
+esp_err_t nvs_flash_init(void);
+esp_err_t nvs_flash_erase(void);
+esp_err_t nvs_open(const char *name, nvs_open_mode_t mode,
+		   nvs_handle_t *handle);
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *out,
+		       size_t *len);
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key,
+		       const void *value, size_t len);
+esp_err_t nvs_commit(nvs_handle_t handle);
+void nvs_close(nvs_handle_t handle);
+
+/* esp_partition.h, esp_system.h */
+#define SPI_FLASH_SEC_SIZE		4096
+
+typedef enum {
+	ESP_PARTITION_TYPE_DATA = 1,
+} esp_partition_type_t;
+
+typedef int esp_partition_subtype_t;
+
+typedef struct {
+	esp_partition_type_t type;
+	esp_partition_subtype_t subtype;
+	uint32_t address;
+	uint32_t size;
+	char label[17];
+} esp_partition_t;
+
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type,
+						esp_partition_subtype_t subtype,
+						const char *label);
+esp_err_t esp_partition_read(const esp_partition_t *partition,
+			     size_t offset, void *dst, size_t size);
+esp_err_t esp_partition_write(const esp_partition_t *partition,
+			      size_t offset, const void *src, size_t size);
+esp_err_t esp_partition_erase_range(const esp_partition_t *partition,
+				    size_t offset, size_t size);
+void esp_restart(void);
+
+/*
+ * The simulation itself. sim_spend() blocks the calling task for the
+ * time a driver call takes on the device, other tasks run meanwhile,
+ * and sim_cpu() for the firmware code it ran. sim_event() schedules fn
+ * to run from the scheduler at virtual time us, which is how DMA and
+ * timers call back. Tasks block on any object with sim_wait() until
+ * sim_wake() on it or a deadline from sim_deadline(). sim_malloc() and
+ * sim_free() are the device heap, which also backs malloc() in the
+ * firmware.
+ */
+struct sim_stat {
+	uint64_t engagements;
+	uint64_t shots;
+	uint64_t i2s_underruns;
+	uint64_t nvs_commits;
+	uint64_t fopen_injected;
+	uint64_t fopen_refused;
+	uint64_t wings_opened;
+	uint64_t wings_short;	/* stopped before the open stop */
+	int64_t wings_stall_us;	/* driven against the open stop */
+	uint64_t outputs;	/* hash of every output change and its time */
+	unsigned files_max;
+	size_t heap_min_free;
+};
+
+extern struct sim_stat sim_stat;
+extern int sim_verbose;
+
+int64_t sim_now(void);
+void sim_spend(int64_t us);
+void sim_cpu(void);
+uint64_t sim_blocks(void);
+void sim_event(int64_t us, void (*fn)(void *arg), void *arg);
+int64_t sim_deadline(TickType_t ticks);
+bool sim_wait(const void *obj, int64_t wake_us);
+void sim_wake(const void *obj);
+bool sim_queue_post(QueueHandle_t queue, const void *item);
+void *sim_malloc(size_t size);
+void *sim_calloc(size_t n, size_t size);
+void sim_free(void *p);
+void sim_fail(const char *fmt, ...) __attribute__((format(printf, 1, 2), noreturn));
+void sim_log(char level, const char *tag, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+uint32_t sim_rand32(void);
+void sim_seed(uint64_t seed);
+bool sim_run(void (*main_fn)(void *arg), int64_t until_us, const char *watch);
+void sim_stop(const char *why);
+void sim_dump(void);
+
+/*
+ * The "record" partition can be loaded from and saved to an image
+ * file, for replays of a run and tools/recdec.py. sim_power_cut()
+ * leaves the wings part open for the next boot, sim_tilt() moves a
+ * head.
+ */
+void sim_hw_init(int fopen_fail_permille);
+void sim_power_cut(void);
+bool sim_flash_load(const char *path);
+bool sim_flash_save(const char *path);
+void sim_tilt(int head, int x);
+
+#endif
@@ -0,0 +1,148 @@
+#include <getopt.h>
+#include <time.h>
+
+#include "sim.h"
+#include "boot.h"
+#include "player.h"
+
+/*
+ * Soak the firmware on the host: app_main boots on the simulated
+ * hardware with CONFIG_TURRET_SOAK, and the latency bench injects
+ * stimuli and checks every window until one fails or the virtual time
+ * runs out. Exits 1 on a failed window or a broken invariant.
+ */
+
+/* The bench injects a target at least every minute */
+#define SOAK_WATCH_US		(60 * 1000000LL)
+#define SOAK_STALL_US		(10 * SOAK_WATCH_US)
+/* The slowest unit closes its wings within 2.5 s */
+#define SOAK_BOOT_US		(10 * 1000000LL)
+
+esp_err_t app_main(void);
+
+static struct timespec start;
+static const char *image;
+static uint64_t last_engagements;
+static int64_t last_engagement_us;
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: soak [-s seed] [-t hours] [-f permille] [-r image] [-b] [-v]\n"
+		"  -s  seed of the run, the same seed repeats it (1)\n"
+		"  -t  virtual hours to run (24)\n"
+		"  -f  fopen calls failed on purpose, per mille (0)\n"
+		"  -r  save the record partition to image, for replay (RECORD=1)\n"
+		"  -b  boot after a power cut with the wings open, for 10 s\n"
+		"  -v  more logs, twice for debug\n");
+	exit(2);
+}
+
+static void report(void)
+{
+	struct timespec end;
+	double hours = sim_now() / 3600e6;
+	double host;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	host = end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("virtual %.2f h in %.1f s host, %.0fx\n", hours, host,
+	       host > 0 ? sim_now() / 1e6 / host : 0);
+	printf("engagements: %" PRIu64 ", %" PRIu64 " shots, %.0f per hour\n",
+	       sim_stat.engagements, sim_stat.shots,
+	       hours > 0 ? sim_stat.engagements / hours : 0);
+	printf("audio: %u underruns, %" PRIu64 " DMA overflows\n",
+	       player_underruns(), sim_stat.i2s_underruns);
+	printf("files: %u open at most, %" PRIu64 " refused, %" PRIu64 " failed on purpose\n",
+	       sim_stat.files_max, sim_stat.fopen_refused,
+	       sim_stat.fopen_injected);
+	printf("wings: %" PRIu64 " opened, %" PRIu64 " short of the stop, %.0f ms against it on average\n",
+	       sim_stat.wings_opened, sim_stat.wings_short,
+	       sim_stat.wings_opened ?
+	       sim_stat.wings_stall_us / 1e3 / sim_stat.wings_opened : 0);
+	printf("heap: %u min free\n", (unsigned)sim_stat.heap_min_free);
+	printf("nvs: %" PRIu64 " commits\n", sim_stat.nvs_commits);
+	printf("outputs: %016" PRIx64 "\n", sim_stat.outputs);
+	boot_stat();
+	if (image && !sim_flash_save(image))
+		printf("cannot write %s\n", image);
+	if (sim_verbose)
+		sim_dump();
+}
+
+/* A turret that stopped engaging never gets idle for the next window */
+static void watch(void *arg)
+{
+	if (sim_stat.engagements != last_engagements) {
+		last_engagements = sim_stat.engagements;
+		last_engagement_us = sim_now();
+	} else if (sim_now() - last_engagement_us > SOAK_STALL_US) {
+		if (sim_verbose)
+			sim_dump();
+		sim_fail("no engagement for %lld s",
+			 (long long)(sim_now() - last_engagement_us) / 1000000);
+	}
+	sim_event(sim_now() + SOAK_WATCH_US, watch, NULL);
+}
+
+static void main_task(void *arg)
+{
+	app_main();
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t seed = 1;
+	double hours = 24;
+	int fail = 0;
+	bool boot = false;
+	int c;
+
+	while ((c = getopt(argc, argv, "s:t:f:r:bv")) != -1) {
+		switch (c) {
+		case 's':
+			seed = strtoull(optarg, NULL, 0);
+			break;
+		case 't':
+			hours = atof(optarg);
+			break;
+		case 'f':
+			fail = atoi(optarg);
+			break;
+		case 'r':
+			image = optarg;
+			break;
+		case 'b':
+			boot = true;
+			break;
+		case 'v':
+			++sim_verbose;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc || hours <= 0)
+		usage();
+#ifndef CONFIG_TURRET_RECORD
+	if (image)
+		usage();
+#endif
+
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	atexit(report);
+	sim_seed(seed);
+	sim_hw_init(fail);
+	if (boot) {
+		sim_power_cut();
+		hours = SOAK_BOOT_US / 3600e6;
+	}
+	sim_event(SOAK_WATCH_US, watch, NULL);
+	if (!sim_run(main_task, hours * 3600e6, "latency_task")) {
+		printf("FAIL: the soak stopped\n");
+		return 1;
+	}
+	printf("PASS\n");
+	return 0;
+}
@@ -0,0 +1,300 @@
+#include "sim.h"
+#include "latency.h"
+#include "tasks.h"
+
+/*
+ * Cost of a control tick with the behaviour tables against the switch
+ * statements they replaced. app_main boots as usual, but the control
+ * task is swapped for a bench that plays the same scripted cycles of
+ * targets, pickups and falls through each engine and counts the basic
+ * blocks of firmware every turret tick runs. The switch code is the
+ * one from before behaviour.def, ported to the current modules.
+ */
+
+static void bench_start(int task, TaskFunction_t fn, void *arg);
+
+#define task_create(task, fn, arg)	bench_start(task, fn, arg)
+#define latency_init()			((void)0)
+#include "app_main.c"
+#undef task_create
+#undef latency_init
+
+#define BENCH_CYCLES		20
+#define BENCH_CYCLE_TICKS	(90 * 1000 / TICK_MS)
+#define BENCH_TICKS		(BENCH_CYCLES * BENCH_CYCLE_TICKS)
+/* Picked up but level, then tipped over, in LSB along x */
+#define BENCH_PICKUP_TILT	100
+#define BENCH_FALL_TILT		300
+
+#define RANDOM_CHANCE(p)	(random() < (long)((p) * 0x7fffffff))
+
+enum {
+	ENGINE_SWITCH,
+	ENGINE_TABLE,
+	ENGINE_N,
+};
+
+static const char * const engine_name[ENGINE_N] = {
+	[ENGINE_SWITCH] = "switch",
+	[ENGINE_TABLE] = "table",
+};
+
+static uint32_t sample[BENCH_TICKS * HEADS];
+
+/* Kept out of line, so that nm sizes them */
+static __attribute__((noinline))
+void switch_stable_tick(struct machine_struct *m, bool target)
+{
+	struct head_struct *h = m->head;
+	bool firing = false;
+
+	if (m->stream && !player_is_playing(m->stream))
+		turret_close_stream(&m->stream);
+
+	switch (m->state) {
+	case STABLE_SEARCH:
+		if (target) {
+			turret_play_one_of(&m->stream, CUE_ALERT);
+			wings_open(h->wings, true);
+			machine_set_state(m, STABLE_OPENING);
+			m->ticks = 0;
+		}
+		break;
+
+	case STABLE_OPENING:
+		if (!m->stream && wings_opened(h->wings)) {
+			machine_set_state(m, STABLE_FIRING);
+			guns_fire(h->guns, true);
+		}
+		break;
+
+	case STABLE_FIRING:
+		if (!target) {
+			machine_set_state(m, STABLE_LOSING);
+			guns_fire(h->guns, false);
+			m->ticks = 0;
+		}
+		break;
+
+	case STABLE_LOSING:
+		if (target) {
+			firing = true;
+		} else if (m->ticks > 100) {
+			wings_scan(h->wings, true);
+			m->ticks = 0;
+			if (RANDOM_CHANCE(0.7)) {
+				turret_play_one_of(&m->stream, CUE_SEARCH);
+				machine_set_state(m, STABLE_LOST);
+			}
+		}
+		break;
+
+	case STABLE_LOST:
+		if (target) {
+			firing = true;
+		} else if (!m->stream && m->ticks > 100) {
+			m->ticks = 0;
+			if (RANDOM_CHANCE(0.2))
+				machine_set_state(m, STABLE_ABOUT_TO_CLOSE);
+			if (RANDOM_CHANCE(0.1))
+				machine_set_state(m, STABLE_LOSING);
+		}
+		break;
+
+	case STABLE_ABOUT_TO_CLOSE:
+		if (target) {
+			firing = true;
+		} else if (m->ticks > 100) {
+			turret_play_one_of(&m->stream, CUE_RETIRE);
+			machine_set_state(m, STABLE_CLOSING);
+			wings_open(h->wings, false);
+		}
+		break;
+
+	case STABLE_CLOSING:
+		if (!m->stream && wings_closed(h->wings))
+			machine_set_state(m, STABLE_SEARCH);
+		break;
+	}
+	++m->ticks;
+
+	if (firing) {
+		if (!m->stream)
+			turret_play_one_of(&m->stream, CUE_ACTIVE);
+		machine_set_state(m, STABLE_FIRING);
+		wings_scan(h->wings, false);
+		guns_fire(h->guns, true);
+	}
+}
+
+static __attribute__((noinline))
+void switch_turret_tick(struct head_struct *h)
+{
+	struct machine_struct *m = &h->turret;
+
+	if (m->stream && !player_is_playing(m->stream))
+		turret_close_stream(&m->stream);
+
+	switch (m->state) {
+	case TURRET_STABLE:
+		laser_on(h, true);
+		if (accel_unstable(h->accel)) {
+			machine_set_state(m, TURRET_WOBBLY);
+			guns_fire(h->guns, false);
+			wings_scan(h->wings, false);
+			m->ticks = 0;
+		} else {
+			switch_stable_tick(m->sub, pir_target_detected(h));
+		}
+		break;
+
+	case TURRET_WOBBLY:
+		laser_on(h, m->ticks & 0x10);
+		if (m->ticks > 10) {
+			turret_close_stream(&m->sub->stream);
+			turret_play_one_of(&m->stream, CUE_PICKUP);
+			machine_set_state(m, TURRET_UNSTABLE);
+		}
+		break;
+
+	case TURRET_UNSTABLE:
+		laser_on(h, m->ticks & 0x10);
+		if (accel_unstable(h->accel)) {
+			if (accel_uneven(h->accel) && m->ticks > 100 &&
+			    RANDOM_CHANCE(0.2)) {
+				turret_play_one_of(&m->stream, CUE_TIPPED);
+				machine_set_state(m, TURRET_FALLEN);
+				wings_open(h->wings, false);
+				laser_on(h, false);
+				machine_set_state(m->sub, STABLE_SEARCH);
+				m->ticks = 0;
+			} else if (!m->stream && RANDOM_CHANCE(0.2)) {
+				turret_play_one_of(&m->stream, CUE_PICKUP);
+			}
+		} else if (m->ticks > 100) {
+			machine_set_state(m, TURRET_STABLE);
+		}
+		break;
+
+	case TURRET_FALLEN:
+		if (accel_uneven(h->accel))
+			m->ticks = 0;
+		else if (m->ticks > 1000)
+			machine_set_state(m, TURRET_STABLE);
+		break;
+	}
+	++m->ticks;
+}
+
+/* A target for 5 s, two short ones to lose, a pickup and a fall */
+static void bench_inputs(int tick)
+{
+	bool target = (tick >= 100 && tick < 600) ||
+		(tick >= 2000 && tick < 2100) ||
+		(tick >= 2300 && tick < 2400);
+	int tilt = 0;
+	int i;
+
+	if (tick >= 3500 && tick < 3800)
+		tilt = BENCH_PICKUP_TILT;
+	else if (tick >= 4500 && tick < 5000)
+		tilt = BENCH_FALL_TILT;
+	for (i = 0; i < HEADS; ++i) {
+		gpio_set_level(head_config[i].pir, target);
+		sim_tilt(i, tilt);
+	}
+}
+
+/* Returns the blocks the turret machines ran */
+static uint32_t bench_head_tick(struct head_struct *h, int engine)
+{
+	uint64_t blocks = sim_blocks();
+
+	if (engine == ENGINE_SWITCH)
+		switch_turret_tick(h);
+	else
+		machine_tick(&h->turret);
+	blocks = sim_blocks() - blocks;
+	accel_tick(h->accel);
+	guns_tick(h->guns);
+	wings_tick(h->wings);
+	return blocks;
+}
+
+static int bench_compare(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void bench_report(int engine, uint64_t shots)
+{
+	int n = BENCH_TICKS * HEADS;
+	uint64_t sum = 0;
+	int i;
+
+	for (i = 0; i < n; ++i)
+		sum += sample[i];
+	qsort(sample, n, sizeof(sample[0]), bench_compare);
+	printf("%-6s blocks per turret tick: mean %.1f, p50 %u, p99 %u, max %u; "
+	       "%" PRIu64 " shots\n", engine_name[engine], (double)sum / n,
+	       sample[n / 2], sample[n * 99 / 100], sample[n - 1], shots);
+}
+
+/* Both engines start from searching with the wings closed */
+static void bench_idle(int engine)
+{
+	int i;
+
+	do {
+		for (i = 0; i < HEADS; ++i)
+			bench_head_tick(head + i, engine);
+		vTaskDelay(TICK_MS / portTICK_PERIOD_MS);
+	} while (!boot_done(BOOT_FATFS) || !heads_idle());
+}
+
+static void bench_task(void *arg)
+{
+	int engine, t, i;
+
+	for (engine = 0; engine < ENGINE_N; ++engine) {
+		uint64_t shots;
+
+		bench_idle(engine);
+		boot_ready();
+		srand(1);
+		shots = sim_stat.shots;
+		for (t = 0; t < BENCH_TICKS; ++t) {
+			bench_inputs(t % BENCH_CYCLE_TICKS);
+			for (i = 0; i < HEADS; ++i)
+				sample[t * HEADS + i] =
+					bench_head_tick(head + i, engine);
+			vTaskDelay(TICK_MS / portTICK_PERIOD_MS);
+		}
+		bench_report(engine, sim_stat.shots - shots);
+	}
+	sim_stop("bench done");
+	vTaskDelete(NULL);
+}
+
+static void bench_start(int task, TaskFunction_t fn, void *arg)
+{
+	(task_create)(task, bench_task, arg);
+}
+
+static void main_task(void *arg)
+{
+	app_main();
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 1 && !strcmp(argv[1], "-v"))
+		++sim_verbose;
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	sim_seed(1);
+	sim_hw_init(0);
+	sim_run(main_task, BENCH_CYCLES * 2 * 120 * 1000000LL, "");
+	return 0;
+}
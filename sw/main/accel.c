@@ -1,7 +1,14 @@
+#include <stdio.h>
+#include <string.h>
 #include "esp_log.h"
 #include "driver/i2c.h"
 
 #include "accel.h"
+#include "head.h"
+#include "latency.h"
+#include "record.h"
+#include "settings.h"
+#include "trace.h"
 
 #define I2C_MASTER_SCL_IO		21
 #define I2C_MASTER_SDA_IO		19
@@ -11,8 +18,6 @@
 #define I2C_MASTER_RX_BUF_DISABLE	0
 #define I2C_MASTER_TIMEOUT_MS		1000
 
-#define ADXL345_ADDR			0x1d
-
 #define ADXL345_ID_REG			0
 #define ADXL345_ID				0xe5
 #define ADXL345_POWER_CTL_REG		0x2d
@@ -25,11 +30,36 @@
 #define ADXL345_DATA_FORMAT_JUSTIFY		0x4
 #define ADXL345_DATA_FORMAT_SELF_TEST		0x80
 #define ADXL345_DATA_REG		0x32
+#define ADXL345_FIFO_CTL_REG		0x38
+#define ADXL345_FIFO_CTL_BYPASS			0x00
+#define ADXL345_FIFO_CTL_STREAM			0x80
+#define ADXL345_FIFO_STATUS_REG		0x39
+#define ADXL345_FIFO_STATUS_ENTRIES		0x3f
 
 #define N_LOG				128
+/* Samples dropped after power up, the control loop is already running */
+#define N_WARMUP			10
 #define ACCEL_G_Z			(-210)
 #define ACCEL_G_2			(ACCEL_G_Z * ACCEL_G_Z)
 
+/*
+ * Once calibrated, pickup is a deviation of the last N_SHORT samples
+ * from the long average by more than ACCEL_CAL_SIGMAS times the noise
+ * of their average, but at least ACCEL_CAL_MIN_DEV, or a long average
+ * off the resting |g|. Neither depends on orientation, so a turret
+ * that settles or is moved a little is stable again once the long
+ * average follows. Tipping is a tilt of the long average by more than
+ * ~40 degrees from rest, which must be within 60 degrees of normal.
+ */
+#define N_SHORT				16
+#define ACCEL_CAL_KEY			"accel"
+#define ACCEL_CAL_VERSION		1
+#define ACCEL_CAL_SIGMAS		6
+#define ACCEL_CAL_MIN_DEV		4
+/* Calibration is retried while the turret moves or is off by > 25% */
+#define ACCEL_CAL_MAX_NOISE		64
+#define ACCEL_CAL_MAX_G_ERR_2		(ACCEL_G_2 * 9 / 16)
+
 struct p3d_struct {
 	int x;
 	int y;
@@ -44,29 +74,50 @@ struct output_struct {
 
 struct accel_struct
 {
+	int head;
+	uint8_t addr;
 	int tick;
+	int warmup;
 	struct p3d_struct average;
+	struct p3d_struct recent;	/* sum of the last N_SHORT samples */
 	struct output_struct log[N_LOG];
 	int log_idx;
+	bool calibrated;
+	struct accel_cal cal;
+	int32_t threshold_2;		/* pickup, on the N_SHORT sum */
+	int32_t g_2;			/* resting |g|^2 */
+	volatile bool cal_request;
+	bool calibrating;
+	int cal_n;
+	struct p3d_struct cal_sum;
+	struct p3d_struct cal_sum_2;
 };
 
-static struct accel_struct accel;
+static struct accel_struct accel[HEADS];
 
-static esp_err_t adxl345_register_read(uint8_t reg_addr, void *data, size_t len)
+static esp_err_t adxl345_register_read(struct accel_struct *a, uint8_t reg_addr,
+				       void *data, size_t len)
 {
-	return i2c_master_write_read_device(I2C_MASTER_NUM, ADXL345_ADDR,
-					    &reg_addr, 1, data, len,
-					    I2C_MASTER_TIMEOUT_MS / portTICK_RATE_MS);
+	esp_err_t ret;
+
+	ret = i2c_master_write_read_device(I2C_MASTER_NUM, a->addr,
+					   &reg_addr, 1, data, len,
+					   I2C_MASTER_TIMEOUT_MS / portTICK_RATE_MS);
+	trace_event(TRACE_I2C, reg_addr << 16 | (ret & 0xffff));
+
+	return ret;
 }
 
-static esp_err_t adxl345_register_write_byte(uint8_t reg_addr, uint8_t data)
+static esp_err_t adxl345_register_write_byte(struct accel_struct *a,
+					     uint8_t reg_addr, uint8_t data)
 {
 	int ret;
 	uint8_t write_buf[2] = {reg_addr, data};
 
-	ret = i2c_master_write_to_device(I2C_MASTER_NUM, ADXL345_ADDR,
+	ret = i2c_master_write_to_device(I2C_MASTER_NUM, a->addr,
 					 write_buf, sizeof(write_buf),
 					 I2C_MASTER_TIMEOUT_MS / portTICK_RATE_MS);
+	trace_event(TRACE_I2C, reg_addr << 16 | (ret & 0xffff));
 
 	return ret;
 }
@@ -88,68 +139,306 @@ static esp_err_t i2c_master_init(void)
 				  I2C_MASTER_TX_BUF_DISABLE, 0);
 }
 
-void accel_init(void)
+/* More than 60 degrees from normal, a chord of |g| */
+static bool accel_tilted(int x, int y, int z)
+{
+	int dz = z - ACCEL_G_Z;
+
+	return x * x + y * y + dz * dz > ACCEL_G_2;
+}
+
+static void accel_cal_apply(struct accel_struct *a, const struct accel_cal *cal)
+{
+	int32_t dev = ACCEL_CAL_MIN_DEV * N_SHORT;
+	int32_t noise = ACCEL_CAL_SIGMAS * ACCEL_CAL_SIGMAS * cal->noise * N_SHORT;
+	struct output_struct o = {
+		cal->g16[0] / 16, cal->g16[1] / 16, cal->g16[2] / 16,
+	};
+	int i;
+
+	a->cal = *cal;
+	a->threshold_2 = noise > dev * dev ? noise : dev * dev;
+	a->g_2 = o.x * o.x + o.y * o.y + o.z * o.z;
+
+	/* Start from rest instead of waiting for the averages to fill */
+	for (i = 0; i < N_LOG; ++i)
+		a->log[i] = o;
+	a->average = (struct p3d_struct){ o.x * N_LOG, o.y * N_LOG, o.z * N_LOG };
+	a->recent = (struct p3d_struct){ o.x * N_SHORT, o.y * N_SHORT, o.z * N_SHORT };
+	a->tick = N_LOG;
+	a->calibrated = true;
+}
+
+static void accel_cal_sample(struct accel_struct *a,
+			     const struct output_struct *o)
+{
+	struct accel_cal cal = { .version = ACCEL_CAL_VERSION };
+	char key[SETTINGS_KEY_SIZE];
+	int32_t g_2, mean[3];
+	int i;
+
+	a->cal_sum.x += o->x;
+	a->cal_sum.y += o->y;
+	a->cal_sum.z += o->z;
+	a->cal_sum_2.x += o->x * o->x;
+	a->cal_sum_2.y += o->y * o->y;
+	a->cal_sum_2.z += o->z * o->z;
+	if (++a->cal_n < N_LOG)
+		return;
+
+	mean[0] = a->cal_sum.x / N_LOG;
+	mean[1] = a->cal_sum.y / N_LOG;
+	mean[2] = a->cal_sum.z / N_LOG;
+	cal.g16[0] = a->cal_sum.x * 16 / N_LOG;
+	cal.g16[1] = a->cal_sum.y * 16 / N_LOG;
+	cal.g16[2] = a->cal_sum.z * 16 / N_LOG;
+	cal.noise = ((int64_t)N_LOG * a->cal_sum_2.x -
+		     (int64_t)a->cal_sum.x * a->cal_sum.x +
+		     (int64_t)N_LOG * a->cal_sum_2.y -
+		     (int64_t)a->cal_sum.y * a->cal_sum.y +
+		     (int64_t)N_LOG * a->cal_sum_2.z -
+		     (int64_t)a->cal_sum.z * a->cal_sum.z) /
+		(N_LOG * N_LOG);
+	for (i = 0, g_2 = 0; i < 3; ++i)
+		g_2 += mean[i] * mean[i];
+
+	a->cal_n = 0;
+	a->cal_sum = (struct p3d_struct){ 0 };
+	a->cal_sum_2 = (struct p3d_struct){ 0 };
+	if (cal.noise > ACCEL_CAL_MAX_NOISE ||
+	    abs(g_2 - ACCEL_G_2) > ACCEL_CAL_MAX_G_ERR_2) {
+		ESP_LOGW(__func__, "head %d not at rest, noise %d, g^2 %d, retrying",
+			 a->head, (int)cal.noise, (int)g_2);
+		return;
+	}
+	if (accel_tilted(mean[0], mean[1], mean[2])) {
+		ESP_LOGW(__func__, "head %d not upright, g = %d, %d, %d, retrying",
+			 a->head, (int)mean[0], (int)mean[1], (int)mean[2]);
+		return;
+	}
+	a->calibrating = false;
+	accel_cal_apply(a, &cal);
+	settings_head_key(key, ACCEL_CAL_KEY, a->head);
+	settings_save(key, &cal, sizeof(cal));
+	ESP_LOGI(__func__, "head %d: g = %d, %d, %d, noise %d", a->head,
+		 (int)mean[0], (int)mean[1], (int)mean[2], (int)cal.noise);
+}
+
+static void accel_head_init(struct accel_struct *a, int head)
 {
+	struct accel_cal cal;
+	char key[SETTINGS_KEY_SIZE];
 	uint8_t id = 0;
 	int i;
 
-	ESP_ERROR_CHECK(i2c_master_init());
+	a->head = head;
+	a->addr = head_config[head].accel_addr;
 	for (i = 0; i < 5; ++i) {
-		adxl345_register_read(ADXL345_ID_REG, &id, sizeof(id));
+		adxl345_register_read(a, ADXL345_ID_REG, &id, sizeof(id));
 		if (id == ADXL345_ID)
 			break;
 		ESP_LOGD(__func__, "ID = 0x%02x\n", id);
 		vTaskDelay(pdMS_TO_TICKS(10));
 	}
-	adxl345_register_write_byte(ADXL345_DATA_FORMAT_REG, ADXL345_DATA_FORMAT_RANGE_2G);
-	adxl345_register_write_byte(ADXL345_POWER_CTL_REG, ADXL345_POWER_CTL_MEASURE);
+	adxl345_register_write_byte(a, ADXL345_DATA_FORMAT_REG, ADXL345_DATA_FORMAT_RANGE_2G);
+	adxl345_register_write_byte(a, ADXL345_POWER_CTL_REG, ADXL345_POWER_CTL_MEASURE);
+	a->warmup = N_WARMUP;
+	settings_head_key(key, ACCEL_CAL_KEY, head);
+	if (settings_load(key, &cal, sizeof(cal)) &&
+	    cal.version == ACCEL_CAL_VERSION &&
+	    !accel_tilted(cal.g16[0] / 16, cal.g16[1] / 16, cal.g16[2] / 16))
+		accel_cal_apply(a, &cal);
+	else
+		a->cal_request = true;
+}
 
-	for (i = 0; i < 10; ++i) {
-		struct output_struct o;
+/* All heads share one bus */
+void accel_init(void)
+{
+	int i;
 
-		vTaskDelay(pdMS_TO_TICKS(10));
-		adxl345_register_read(ADXL345_DATA_REG, &o, sizeof(o));
-		ESP_LOGD(__func__, "x = %d, y = %d, z = %d\n", o.x, o.y, o.z);
+	ESP_ERROR_CHECK(i2c_master_init());
+	for (i = 0; i < HEADS; ++i)
+		accel_head_init(accel + i, i);
+}
+
+struct accel_struct *accel_head(int head)
+{
+	return accel + head;
+}
+
+/* Measure the resting vectors and noise again, the turrets must be still */
+void accel_calibrate(void)
+{
+	int i;
+
+	for (i = 0; i < HEADS; ++i)
+		accel[i].cal_request = true;
+}
+
+void accel_cal_get(struct accel_struct *a, struct accel_cal *cal)
+{
+	if (a->calibrated)
+		*cal = a->cal;
+	else
+		*cal = (struct accel_cal){ 0 };
+}
+
+/*
+ * Back to the state accel_head_init() leaves with this calibration,
+ * replays start from the recorded one.
+ */
+void accel_cal_set(struct accel_struct *a, const struct accel_cal *cal)
+{
+	a->calibrating = false;
+	a->cal_request = false;
+	if (cal->version == ACCEL_CAL_VERSION) {
+		accel_cal_apply(a, cal);
+		return;
 	}
+	memset(a->log, 0, sizeof(a->log));
+	a->average = (struct p3d_struct){ 0 };
+	a->recent = (struct p3d_struct){ 0 };
+	a->tick = 0;
+	a->calibrated = false;
+	a->cal_request = true;
 }
 
-void accel_tick(void)
+void accel_tick(struct accel_struct *a)
 {
 	struct output_struct o;
+	const struct output_struct *old;
 
-	if (accel.tick < N_LOG)
-		++accel.tick;
-	adxl345_register_read(ADXL345_DATA_REG, &o, sizeof(o));
-	accel.average.x += o.x - accel.log[accel.log_idx].x;
-	accel.average.y += o.y - accel.log[accel.log_idx].y;
-	accel.average.z += o.z - accel.log[accel.log_idx].z;
-	accel.log[accel.log_idx] = o;
-	accel.log_idx = (accel.log_idx + 1) % N_LOG;
+	adxl345_register_read(a, ADXL345_DATA_REG, &o, sizeof(o));
+	o.x += latency_inject_accel();
+	record_accel(&o.x, &o.y, &o.z);
+	if (a->warmup) {
+		--a->warmup;
+		ESP_LOGD(__func__, "x = %d, y = %d, z = %d", o.x, o.y, o.z);
+		return;
+	}
+	if (a->cal_request) {
+		a->cal_request = false;
+		a->cal_n = 0;
+		a->cal_sum = (struct p3d_struct){ 0 };
+		a->cal_sum_2 = (struct p3d_struct){ 0 };
+		a->calibrating = true;
+	}
+	if (a->calibrating)
+		accel_cal_sample(a, &o);
+	if (a->tick < N_LOG)
+		++a->tick;
+	old = a->log + (a->log_idx + N_LOG - N_SHORT) % N_LOG;
+	a->recent.x += o.x - old->x;
+	a->recent.y += o.y - old->y;
+	a->recent.z += o.z - old->z;
+	a->average.x += o.x - a->log[a->log_idx].x;
+	a->average.y += o.y - a->log[a->log_idx].y;
+	a->average.z += o.z - a->log[a->log_idx].z;
+	a->log[a->log_idx] = o;
+	a->log_idx = (a->log_idx + 1) % N_LOG;
 }
 
-/* Average gravity vector length deviates from g by more than ~15% */
-bool accel_unstable(void)
+/*
+ * Calibrated: the recent average moved away from the long one by more
+ * than the noise allows, or the long average length deviates from the
+ * resting one. Otherwise: average gravity vector length deviates from
+ * g by more than ~15%.
+ */
+bool accel_unstable(struct accel_struct *a)
 {
-	int dx = accel.average.x / N_LOG;
-	int dy = accel.average.y / N_LOG;
-	int dz = accel.average.z / N_LOG;
+	int dx = a->average.x / N_LOG;
+	int dy = a->average.y / N_LOG;
+	int dz = a->average.z / N_LOG;
 
 	int diff = abs((dx * dx + dy * dy + dz * dz) - ACCEL_G_2);
 
-	if (accel.tick < N_LOG)
+	if (a->calibrated) {
+		int rx = a->recent.x - a->average.x / (N_LOG / N_SHORT);
+		int ry = a->recent.y - a->average.y / (N_LOG / N_SHORT);
+		int rz = a->recent.z - a->average.z / (N_LOG / N_SHORT);
+
+		diff = abs((dx * dx + dy * dy + dz * dz) - a->g_2);
+		return rx * rx + ry * ry + rz * rz > a->threshold_2 ||
+			diff > a->g_2 / 32 || accel_uneven(a);
+	}
+	if (a->tick < N_LOG)
 		return false;
 
 	//ESP_LOGI(__func__, "%d, %d, %d, diff = %d", dx, dy, dz, diff);
-	return diff > ACCEL_G_2 / 32 || accel_uneven();
+	return diff > ACCEL_G_2 / 32 || accel_uneven(a);
 }
 
-/* Gravity vector deviates from normal by more than 60 degrees */
-bool accel_uneven(void)
+/*
+ * Gravity vector deviates from rest by more than ~40 degrees when
+ * calibrated, from normal by more than 60 degrees otherwise.
+ */
+bool accel_uneven(struct accel_struct *a)
 {
-	int dx = accel.average.x / N_LOG;
-	int dy = accel.average.y / N_LOG;
-	int dz = accel.average.z / N_LOG - ACCEL_G_Z;
+	int dx = a->average.x / N_LOG;
+	int dy = a->average.y / N_LOG;
+	int dz = a->average.z / N_LOG;
+
+	if (a->calibrated) {
+		dx -= a->cal.g16[0] / 16;
+		dy -= a->cal.g16[1] / 16;
+		dz -= a->cal.g16[2] / 16;
+		/* a chord of |g| / sqrt(2) */
+		return 2 * (dx * dx + dy * dy + dz * dz) > a->g_2;
+	}
 
 	//ESP_LOGI(__func__, "%d, %d, %d", dx, dy, dz);
-	return (dx * dx + dy * dy + dz * dz) > ACCEL_G_Z * ACCEL_G_Z;
+	return accel_tilted(dx, dy, dz);
+}
+
+/*
+ * In stream mode the ADXL345 keeps the last 32 samples (320 ms at the
+ * default 100 Hz rate) and every data register read pops the oldest
+ * one, so the control loop may sleep and catch up one tick per sample.
+ * Switching back to bypass discards whatever is left.
+ */
+void accel_fifo(bool on)
+{
+	int i;
+
+	for (i = 0; i < HEADS; ++i)
+		adxl345_register_write_byte(accel + i, ADXL345_FIFO_CTL_REG,
+					    on ? ADXL345_FIFO_CTL_STREAM :
+					    ADXL345_FIFO_CTL_BYPASS);
+}
+
+/* Samples that every head has */
+int accel_fifo_entries(void)
+{
+	int i, n = ADXL345_FIFO_STATUS_ENTRIES;
+
+	for (i = 0; i < HEADS; ++i) {
+		uint8_t status = 0;
+
+		adxl345_register_read(accel + i, ADXL345_FIFO_STATUS_REG,
+				      &status, sizeof(status));
+		if ((status & ADXL345_FIFO_STATUS_ENTRIES) < n)
+			n = status & ADXL345_FIFO_STATUS_ENTRIES;
+	}
+	return n;
+}
+
+void accel_stat(void)
+{
+	int i;
+
+	for (i = 0; i < HEADS; ++i) {
+		const struct accel_struct *a = accel + i;
+
+		if (HEADS > 1)
+			printf("head %d at 0x%02x:\n", i, a->addr);
+		if (a->calibrated)
+			printf("rest: %d, %d, %d (1/16 LSB), noise %d LSB^2\n",
+			       (int)a->cal.g16[0], (int)a->cal.g16[1],
+			       (int)a->cal.g16[2], (int)a->cal.noise);
+		else
+			printf("not calibrated\n");
+		if (a->calibrating)
+			printf("calibrating, %d of %d samples\n", a->cal_n, N_LOG);
+	}
 }
@@ -1,9 +1,28 @@
 #ifndef ACCEL_H
 #define ACCEL_H
 
+#include <stdbool.h>
+#include <stdint.h>
+
+struct accel_struct;
+
+/* What accel_calibrate() measured, version 0 -- not calibrated */
+struct accel_cal {
+	uint32_t version;
+	int32_t g16[3];		/* resting gravity vector, 1/16 LSB */
+	int32_t noise;		/* variance summed over the axes, LSB^2 */
+};
+
 void accel_init(void);
-void accel_tick(void);
-bool accel_unstable(void);
-bool accel_uneven(void);
+struct accel_struct *accel_head(int head);
+void accel_tick(struct accel_struct *a);
+bool accel_unstable(struct accel_struct *a);
+bool accel_uneven(struct accel_struct *a);
+void accel_fifo(bool on);
+int accel_fifo_entries(void);
+void accel_calibrate(void);
+void accel_cal_get(struct accel_struct *a, struct accel_cal *cal);
+void accel_cal_set(struct accel_struct *a, const struct accel_cal *cal);
+void accel_stat(void);
 
 #endif
@@ -9,20 +9,44 @@
 #include "freertos/task.h"
 
 #include "accel.h"
+#include "boot.h"
+#include "console.h"
+#include "cues.h"
 #include "guns.h"
+#include "head.h"
+#include "latency.h"
+#include "mem.h"
 #include "player.h"
+#include "power.h"
+#include "record.h"
+#include "settings.h"
+#include "tasks.h"
+#include "timing.h"
+#include "trace.h"
 #include "wings.h"
 
-#define GPIO_PIR	22
-#define GPIO_LASER	14
+#define TICK_MS			10
+/* Turret, stable and guns streams of every head, one staged or reopened */
+#define FATFS_MAX_FILES		(3 * HEADS + 1)
 
-#define RANDOM_CHANCE(p)	(random() < (long)((p) * 0x7fffffff))
+enum {
+	BOOT_SETTINGS,
+	BOOT_WINGS,
+	BOOT_IO,
+	BOOT_ACCEL,
+	BOOT_PLAYER,
+	BOOT_RECORD,
+	BOOT_FATFS,
+	BOOT_CONTROL,
+	BOOT_DEBUG,
+	BOOT_N,
+};
 
 static bool mount_fatfs(const char* partition_label)
 {
 	ESP_LOGI(__func__, "Mounting FAT filesystem");
 	const esp_vfs_fat_mount_config_t mount_config = {
-		.max_files = 4,
+		.max_files = FATFS_MAX_FILES,
 		.format_if_mount_failed = true,
 		.allocation_unit_size = 512,
 	};
@@ -41,67 +65,223 @@ static void pir_init(void)
 	gpio_config_t io_conf = {
 		.intr_type = GPIO_INTR_DISABLE,
 		.mode = GPIO_MODE_INPUT,
-		.pin_bit_mask = (1 << GPIO_PIR),
 	};
+	int i;
+
+	for (i = 0; i < HEADS; ++i)
+		io_conf.pin_bit_mask |= 1ULL << head_config[i].pir;
 	gpio_config(&io_conf);
 }
 
-static bool pir_target_detected(void)
-{
-	return gpio_get_level(GPIO_PIR);
-}
+/* Set while catching up past ticks, before the PIR woke the turret */
+static bool pir_masked;
 
 static void laser_init(void)
 {
 	gpio_config_t io_conf = {
 		.intr_type = GPIO_INTR_DISABLE,
 		.mode = GPIO_MODE_OUTPUT,
-		.pin_bit_mask = (1 << GPIO_LASER),
 	};
+	int i;
+
+	for (i = 0; i < HEADS; ++i)
+		io_conf.pin_bit_mask |= 1ULL << head_config[i].laser;
 	gpio_config(&io_conf);
 }
 
-static void laser_on(bool on)
-{
-	gpio_set_level(GPIO_LASER, on);
-}
+#define STATE_SAME		(-1)
 
 enum {
-	STATE_STABLE,
-	STATE_WOBBLY,
-	STATE_UNSTABLE,
-	STATE_FALLEN,
+	LASER_KEEP,
+	LASER_ON,
+	LASER_BLINK,
 };
 
+/* Rule inputs, sampled once per tick */
 enum {
-	STATE_SEARCH,
-	STATE_OPENING,
-	STATE_FIRING,
-	STATE_LOSING,
-	STATE_LOST,
-	STATE_ABOUT_TO_CLOSE,
-	STATE_CLOSING,
+	IN_TARGET	= 1 << 0,
+	IN_UNSTABLE	= 1 << 1,
+	IN_UNEVEN	= 1 << 2,
+	IN_OPENED	= 1 << 3,
+	IN_CLOSED	= 1 << 4,
+	IN_PLAYING	= 1 << 5,	/* the machine's own stream */
 };
 
+/* Rule actions, run in this order */
 enum {
-	TRANSITION_NONE,
-	TRANSITION_FIRING,
+	ACT_SUB_CLOSE		= 1 << 0,	/* close the sub machine stream */
+	ACT_CUE_IF_SILENT	= 1 << 1,	/* play the cue only if silent */
+	ACT_WINGS_OPEN		= 1 << 2,
+	ACT_WINGS_CLOSE		= 1 << 3,
+	ACT_SCAN_ON		= 1 << 4,
+	ACT_SCAN_OFF		= 1 << 5,
+	ACT_FIRE_ON		= 1 << 6,
+	ACT_FIRE_OFF		= 1 << 7,
+	ACT_LASER_OFF		= 1 << 8,
+	ACT_SUB_RESET		= 1 << 9,	/* sub machine to its first state */
+	ACT_RESET_TICKS		= 1 << 10,
 };
 
-struct stable_struct {
-	int state;
-	void *stream;
-	int ticks;
+enum {
+#define TURRET(state, ...) TURRET_##state,
+#include "behaviour.def"
+	TURRET_N,
+	TURRET_SAME = STATE_SAME,
+};
+
+enum {
+#define STABLE(state, ...) STABLE_##state,
+#include "behaviour.def"
+	STABLE_N,
+	STABLE_SAME = STATE_SAME,
+};
+
+struct state_desc {
+	const char *name;
+	uint8_t laser;
+	bool sub;
+	uint8_t prefetch[3];	/* cue groups, most likely first */
+};
+
+struct rule_desc {
+	uint8_t state;
+	uint8_t set;
+	uint8_t clear;
+	uint8_t chance;		/* percent */
+	uint16_t after;		/* ticks, 0 -- any */
+	uint16_t actions;
+	int8_t next;
+	uint8_t cue;
+};
+
+/* The rules of a state, found by machine_index() */
+struct rule_index {
+	uint8_t first;
+	uint8_t n;
+	uint8_t inputs;		/* sampled while in the state */
+};
+
+struct machine_desc {
+	const struct state_desc *state;
+	const struct rule_desc *rule;
+	int n_rules;
+	int trace;
+	struct rule_index *index;
+};
+
+static const struct state_desc turret_state[TURRET_N] = {
+#define TURRET(state, name, laser, sub, p0, p1, p2) \
+	[TURRET_##state] = { name, LASER_##laser, sub, { CUE_##p0, CUE_##p1, CUE_##p2 } },
+#include "behaviour.def"
+};
+
+static const struct state_desc stable_state[STABLE_N] = {
+#define STABLE(state, name, p0, p1, p2) \
+	[STABLE_##state] = { name, LASER_KEEP, false, { CUE_##p0, CUE_##p1, CUE_##p2 } },
+#include "behaviour.def"
+};
+
+#define RULE_DESC(machine, state, set, clear, after, chance, next, actions, cue) \
+	{ machine##_##state, set, clear, chance, after, actions, machine##_##next, CUE_##cue },
+
+static const struct rule_desc turret_rule[] = {
+#define RULE(machine, ...) RULE_##machine(machine, __VA_ARGS__)
+#define RULE_TURRET RULE_DESC
+#define RULE_STABLE(...)
+#include "behaviour.def"
+#undef RULE_TURRET
+#undef RULE_STABLE
+};
+
+static const struct rule_desc stable_rule[] = {
+#define RULE(machine, ...) RULE_##machine(machine, __VA_ARGS__)
+#define RULE_TURRET(...)
+#define RULE_STABLE RULE_DESC
+#include "behaviour.def"
+#undef RULE_TURRET
+#undef RULE_STABLE
+};
+
+static struct rule_index turret_index[TURRET_N];
+static struct rule_index stable_index[STABLE_N];
+
+static const struct machine_desc turret_desc = {
+	turret_state, turret_rule,
+	sizeof(turret_rule) / sizeof(turret_rule[0]), TRACE_TURRET_STATE,
+	turret_index,
+};
+
+static const struct machine_desc stable_desc = {
+	stable_state, stable_rule,
+	sizeof(stable_rule) / sizeof(stable_rule[0]), TRACE_STABLE_STATE,
+	stable_index,
 };
 
-struct turret_struct {
+struct machine_struct {
+	const struct machine_desc *desc;
 	int state;
 	void *stream;
 	int ticks;
-	struct stable_struct stable;
+	struct machine_struct *sub;
+	struct head_struct *head;
 };
 
-static struct turret_struct turret;
+/* One turret, its machines and the modules they drive */
+struct head_struct {
+	const struct head_config *cfg;
+	struct machine_struct turret;
+	struct machine_struct stable;
+	struct guns_struct *guns;
+	struct wings_struct *wings;
+	struct accel_struct *accel;
+	bool laser;
+};
+
+static struct head_struct head[HEADS];
+
+/* Targets are ignored until the cues can be played */
+static bool pir_target_detected(const struct head_struct *h)
+{
+	return record_pir(latency_inject_pir() ||
+			  (!pir_masked && boot_done(BOOT_FATFS) &&
+			   gpio_get_level(h->cfg->pir)));
+}
+
+static void laser_on(struct head_struct *h, bool on)
+{
+	if (on != h->laser) {
+		h->laser = on;
+		latency_response(LATENCY_GPIO);
+	}
+	gpio_set_level(h->cfg->laser, on);
+}
+
+/*
+ * Stage the cues of the innermost running state. The heads share the
+ * player, so the last head to change state decides what is staged.
+ */
+static void turret_prefetch(const struct machine_struct *m)
+{
+	const struct state_desc *s;
+
+	while (m->desc->state[m->state].sub)
+		m = m->sub;
+	s = m->desc->state + m->state;
+	player_prepare(s->prefetch, sizeof(s->prefetch));
+}
+
+static void machine_set_state(struct machine_struct *m, int state)
+{
+	const struct machine_struct *active = &m->head->turret;
+
+	m->state = state;
+	trace_event(m->desc->trace, (m->head - head) << 8 | state);
+	ESP_LOGD(__func__, "%s", m->desc->state[state].name);
+	while (active != m && active->desc->state[active->state].sub)
+		active = active->sub;
+	if (active == m)
+		turret_prefetch(m);
+}
 
 static void turret_close_stream(void **stream)
 {
@@ -111,243 +291,270 @@ static void turret_close_stream(void **stream)
 	}
 }
 
-static void turret_play_one_of(void **stream, const char * const name[])
+static void turret_play_one_of(void **stream, int cue)
 {
-	int i;
+	const struct cue_group *g = cue_group + cue;
 
-	for (i = 0; name[i]; ++i);
 	turret_close_stream(stream);
-	*stream = player_play(name[random() % i]);
+	*stream = player_play_id(g->clip[g->n > 1 ? random() % g->n : 0]);
 }
 
-static void stable_tick(struct stable_struct *stable)
+/* Samples only the inputs in mask, the others read as clear */
+static unsigned turret_inputs(struct head_struct *h, unsigned mask)
 {
-	bool target_detected = pir_target_detected();
-	int transition = TRANSITION_NONE;
-
-	if (stable->stream && !player_is_playing(stable->stream))
-		turret_close_stream(&stable->stream);
-
-	switch (stable->state) {
-	case STATE_SEARCH:
-		if (target_detected) {
-			wings_open(true);
-			stable->state = STATE_OPENING;
-			ESP_LOGI(__func__, "opening\n");
-			stable->ticks = 0;
-			stable->stream = player_play("/audio/09/013_alert.mp3.s8");
-		}
-		break;
+	unsigned in = 0;
+
+	if ((mask & IN_TARGET) && pir_target_detected(h))
+		in |= IN_TARGET;
+	if ((mask & IN_UNSTABLE) && accel_unstable(h->accel))
+		in |= IN_UNSTABLE;
+	if ((mask & IN_UNEVEN) && accel_uneven(h->accel))
+		in |= IN_UNEVEN;
+	if ((mask & IN_OPENED) && wings_opened(h->wings))
+		in |= IN_OPENED;
+	if ((mask & IN_CLOSED) && wings_closed(h->wings))
+		in |= IN_CLOSED;
+	return in;
+}
 
-	case STATE_OPENING:
-		if (!stable->stream && wings_opened()) {
-			stable->state = STATE_FIRING;
-			ESP_LOGI(__func__, "firing\n");
-			guns_fire(true);
-		}
-		break;
-
-	case STATE_FIRING:
-		if (!target_detected) {
-			stable->state = STATE_LOSING;
-			ESP_LOGI(__func__, "losing\n");
-			guns_fire(false);
-			stable->ticks = 0;
-		}
-		break;
-
-	case STATE_LOSING:
-		if (target_detected) {
-			transition = TRANSITION_FIRING;
-		} else if (stable->ticks > 100) {
-			wings_scan(true);
-			stable->ticks = 0;
-			if (RANDOM_CHANCE(0.7)) {
-				stable->state = STATE_LOST;
-				ESP_LOGI(__func__, "lost\n");
-				/* are you still there? */
-				turret_play_one_of(&stable->stream,
-						   (const char * const []){
-						   "/audio/07/002_search.mp3.s8",
-						   "/audio/07/005_search.mp3.s8",
-						   "/audio/07/006_autosearch.mp3.s8",
-						   "/audio/07/010_autosearch.mp3.s8",
-						   NULL,
-						   });
-			}
-		}
-		break;
-
-	case STATE_LOST:
-		if (target_detected) {
-			transition = TRANSITION_FIRING;
-		} else if (!stable->stream) {
-			if (stable->ticks > 100) {
-				stable->ticks = 0;
-				if (RANDOM_CHANCE(0.2)) {
-					stable->state = STATE_ABOUT_TO_CLOSE;
-					ESP_LOGI(__func__, "about to close\n");
-				}
-				if (RANDOM_CHANCE(0.1)) {
-					stable->state = STATE_LOSING;
-					ESP_LOGI(__func__, "losing\n");
-				}
-			}
-		}
-		break;
-
-	case STATE_ABOUT_TO_CLOSE:
-		if (target_detected) {
-			transition = TRANSITION_FIRING;
-		} else if (stable->ticks > 100) {
-			stable->state = STATE_CLOSING;
-			ESP_LOGI(__func__, "closing\n");
-			wings_open(false);
-			/* hibernating */
-			turret_play_one_of(&stable->stream,
-					   (const char * const []){
-					   "/audio/07/003_search.mp3.s8",
-					   "/audio/06/001_retire.mp3.s8",
-					   "/audio/06/002_retire.mp3.s8",
-					   "/audio/06/003_retire.mp3.s8",
-					   NULL,
-					   });
-		}
-		break;
+/*
+ * Rules of a state are adjacent in behaviour.def, tools/behaviour.py
+ * checks that, so a tick only looks at its own.
+ */
+static void machine_index(const struct machine_desc *desc)
+{
+	int i;
 
-	case STATE_CLOSING:
-		if (!stable->stream && wings_closed()) {
-			ESP_LOGI(__func__, "search\n");
-			stable->state = STATE_SEARCH;
-		}
-		break;
+	for (i = desc->n_rules - 1; i >= 0; --i) {
+		const struct rule_desc *r = desc->rule + i;
+		struct rule_index *x = desc->index + r->state;
+
+		x->first = i;
+		++x->n;
+		x->inputs |= r->set | r->clear;
 	}
-	++stable->ticks;
-
-	switch (transition) {
-	case TRANSITION_FIRING:
-		if (!stable->stream) {
-			/* there you are */
-			turret_play_one_of(&stable->stream,
-					   (const char * const []){
-					   "/audio/01/002_active.mp3.s8",
-					   "/audio/01/007_active.mp3.s8",
-					   "/audio/01/008_active.mp3.s8",
-					   NULL,
-					   });
+}
+
+static bool machine_match(const struct machine_struct *m,
+			  const struct rule_desc *r, unsigned in)
+{
+	return (in & r->set) == r->set && !(in & r->clear) &&
+		(!r->after || m->ticks > r->after) &&
+		(r->chance >= 100 || random() % 100 < r->chance);
+}
+
+static void machine_run(struct machine_struct *m, const struct rule_desc *r)
+{
+	struct head_struct *h = m->head;
+	unsigned act = r->actions;
+
+	if (act & ACT_SUB_CLOSE)
+		turret_close_stream(&m->sub->stream);
+	if (r->cue && (!(act & ACT_CUE_IF_SILENT) || !m->stream))
+		turret_play_one_of(&m->stream, r->cue);
+	if (act & (ACT_WINGS_OPEN | ACT_WINGS_CLOSE))
+		wings_open(h->wings, act & ACT_WINGS_OPEN);
+	if (act & (ACT_SCAN_ON | ACT_SCAN_OFF))
+		wings_scan(h->wings, act & ACT_SCAN_ON);
+	if (act & (ACT_FIRE_ON | ACT_FIRE_OFF))
+		guns_fire(h->guns, act & ACT_FIRE_ON);
+	if (act & ACT_LASER_OFF)
+		laser_on(h, false);
+	if (r->next != STATE_SAME)
+		machine_set_state(m, r->next);
+	if (act & ACT_SUB_RESET)
+		machine_set_state(m->sub, 0);
+	if (act & ACT_RESET_TICKS)
+		m->ticks = 0;
+}
+
+/*
+ * Fires the first matching rule of the current state, or if there is
+ * none and the state has a sub machine, ticks that one instead.
+ */
+static void machine_tick(struct machine_struct *m)
+{
+	const struct machine_desc *desc = m->desc;
+	const struct state_desc *s = desc->state + m->state;
+	const struct rule_index *x = desc->index + m->state;
+	unsigned in;
+	int i;
+
+	if (m->stream && !player_is_playing(m->stream))
+		turret_close_stream(&m->stream);
+
+	if (s->laser == LASER_ON)
+		laser_on(m->head, true);
+	else if (s->laser == LASER_BLINK)
+		laser_on(m->head, m->ticks & 0x10);
+
+	in = turret_inputs(m->head, x->inputs);
+	if (m->stream)
+		in |= IN_PLAYING;
+	for (i = x->first; i < x->first + x->n; ++i) {
+		if (machine_match(m, desc->rule + i, in)) {
+			machine_run(m, desc->rule + i);
+			break;
 		}
-		stable->state = STATE_FIRING;
-		ESP_LOGI(__func__, "firing\n");
-		wings_scan(false);
-		guns_fire(true);
-		break;
 	}
+	if (i == x->first + x->n && s->sub)
+		machine_tick(m->sub);
+	++m->ticks;
 }
 
-static void turret_tick(struct turret_struct *turret)
+/* Searching with wings closed and nothing to say */
+static bool turret_idle(struct head_struct *h)
 {
-	if (turret->stream && !player_is_playing(turret->stream))
-		turret_close_stream(&turret->stream);
-
-	switch (turret->state) {
-	case STATE_STABLE:
-		laser_on(true);
-		if (accel_unstable()) {
-			turret->state = STATE_WOBBLY;
-			ESP_LOGI(__func__, "wobbly\n");
-			guns_fire(false);
-			wings_scan(false);
-			turret->ticks = 0;
-		} else {
-			stable_tick(&turret->stable);
-		}
-		break;
-
-	case STATE_WOBBLY:
-		laser_on(turret->ticks & 0x10);
-		if (turret->ticks > 10) {
-			turret->state = STATE_UNSTABLE;
-			ESP_LOGI(__func__, "unstable\n");
-			turret_close_stream(&turret->stable.stream);
-			/* put me down */
-			turret_play_one_of(&turret->stream,
-					   (const char * const []){
-					   "/audio/05/001_pickup.mp3.s8",
-					   "/audio/05/005_pickup.mp3.s8",
-					   "/audio/05/006_pickup.mp3.s8",
-					   "/audio/05/007_pickup.mp3.s8",
-					   "/audio/05/008_pickup.mp3.s8",
-					   NULL,
-					   });
-		}
-		break;
-
-	case STATE_UNSTABLE:
-		laser_on(turret->ticks & 0x10);
-		if (accel_unstable()) {
-			if (accel_uneven() && turret->ticks > 100 && RANDOM_CHANCE(0.2)) {
-				turret->state = STATE_FALLEN;
-				ESP_LOGI(__func__, "fallen\n");
-				wings_open(false);
-				laser_on(false);
-				turret->stable.state = STATE_SEARCH;
-				/* critical error */
-				turret_play_one_of(&turret->stream,
-						   (const char * const []){
-						   "/audio/08/003_tipped.mp3.s8",
-						   "/audio/08/001_tipped.mp3.s8",
-						   "/audio/04/003_disabled.mp3.s8",
-						   "/audio/04/008_disabled.mp3.s8",
-						   NULL,
-						   });
-				turret->ticks = 0;
-			} else if (!turret->stream && RANDOM_CHANCE(0.2)) {
-				/* put me down */
-				turret_play_one_of(&turret->stream,
-						   (const char * const []){
-						   "/audio/05/001_pickup.mp3.s8",
-						   "/audio/05/005_pickup.mp3.s8",
-						   "/audio/05/006_pickup.mp3.s8",
-						   "/audio/05/007_pickup.mp3.s8",
-						   "/audio/05/008_pickup.mp3.s8",
-						   NULL,
-						   });
-			}
-		} else if (turret->ticks > 100) {
-			turret->state = STATE_STABLE;
-			ESP_LOGI(__func__, "stable\n");
-		}
-		break;
-
-	case STATE_FALLEN:
-		if (accel_uneven()) {
-			turret->ticks = 0;
-		} else if (turret->ticks > 1000) {
-			turret->state = STATE_STABLE;
-			ESP_LOGI(__func__, "stable\n");
+	const struct machine_struct *turret = &h->turret;
+
+	return turret->state == TURRET_STABLE &&
+		turret->sub->state == STABLE_SEARCH &&
+		!turret->stream && !turret->sub->stream &&
+		wings_closed(h->wings);
+}
+
+static bool heads_idle(void)
+{
+	int i;
+
+	for (i = 0; i < HEADS; ++i)
+		if (!turret_idle(head + i))
+			return false;
+	return true;
+}
+
+static void head_tick(struct head_struct *h)
+{
+	uint32_t begin, t;
+
+	begin = t = timing_begin();
+	machine_tick(&h->turret);
+	t = timing_end(TIMING_MACHINE_TICK, t);
+	accel_tick(h->accel);
+	t = timing_end(TIMING_ACCEL_TICK, t);
+	guns_tick(h->guns);
+	t = timing_end(TIMING_GUNS_TICK, t);
+	wings_tick(h->wings);
+	timing_end(TIMING_WINGS_TICK, t);
+	timing_end(TIMING_HEAD_TICK, begin);
+}
+
+/* All heads are ticked in turn, every TICK_MS */
+static void control_tick(void)
+{
+	int64_t begin = latency_tick_begin();
+	int i;
+
+	record_tick();
+	for (i = 0; i < HEADS; ++i)
+		head_tick(head + i);
+	latency_tick_end(begin);
+}
+
+/* Returns the number of ticks to run */
+static int control_wait(void)
+{
+	if (!power_idle(heads_idle())) {
+		vTaskDelay(TICK_MS / portTICK_PERIOD_MS);
+		return 1;
+	}
+	return power_sleep();
+}
+
+static void control_task(void *arg)
+{
+	power_init(head_config[0].pir);
+	for (;;) {
+		int ticks = control_wait();
+
+		/*
+		 * In idle mode the accelerometer FIFO is drained one
+		 * tick per sample. Only the last tick sees the PIR,
+		 * earlier ones happened before it woke us up.
+		 */
+		while (ticks--) {
+			pir_masked = ticks > 0;
+			control_tick();
 		}
-		break;
+		pir_masked = false;
+		if (boot_done(BOOT_FATFS) && heads_idle())
+			boot_ready();
+#ifdef CONFIG_TURRET_LATENCY_BENCH
+		latency_idle(heads_idle());
+#endif
 	}
-	++turret->ticks;
 }
 
-esp_err_t app_main(void)
+static void fatfs_init(void)
 {
-	srand(esp_random());
 	mount_fatfs("storage");
+}
+
+static void io_init(void)
+{
 	laser_init();
-	player_init();
-	accel_init();
 	pir_init();
 	guns_init();
-	wings_init();
+}
 
-	for (;;) {
-		turret_tick(&turret);
-		accel_tick();
-		guns_tick();
-		wings_tick();
-		vTaskDelay(10 / portTICK_PERIOD_MS);
+static void control_init(void)
+{
+	int i;
+
+	machine_index(&turret_desc);
+	machine_index(&stable_desc);
+	for (i = 0; i < HEADS; ++i) {
+		struct head_struct *h = head + i;
+
+		h->cfg = head_config + i;
+		h->turret = (struct machine_struct){
+			.desc = &turret_desc,
+			.sub = &h->stable,
+			.head = h,
+		};
+		h->stable = (struct machine_struct){
+			.desc = &stable_desc,
+			.head = h,
+		};
+		h->guns = guns_head(i);
+		h->wings = wings_head(i);
+		h->accel = accel_head(i);
 	}
+	task_create(TASK_CONTROL, control_task, NULL);
+}
+
+static void debug_init(void)
+{
+	latency_init();
+	mem_init();
+	console_init();
+}
+
+/*
+ * The control loop starts as soon as its inputs and outputs are up, so
+ * that the wings home while FAT is mounted, which may include
+ * formatting it. Targets are only acted upon after the mount.
+ */
+static const struct boot_phase boot_phase[BOOT_N] = {
+	[BOOT_SETTINGS] = { "settings", settings_init, BOOT_LANE_MAIN },
+	[BOOT_WINGS] = { "wings", wings_init, BOOT_LANE_MAIN },
+	[BOOT_IO] = { "io", io_init, BOOT_LANE_MAIN },
+	[BOOT_ACCEL] = { "accel", accel_init, BOOT_LANE_MAIN },
+	[BOOT_PLAYER] = { "player", player_init, BOOT_LANE_MAIN },
+	[BOOT_RECORD] = { "record", record_init, BOOT_LANE_MAIN },
+	[BOOT_FATFS] = { "fatfs", fatfs_init, BOOT_LANE_WORKER },
+	[BOOT_CONTROL] = {
+		"control", control_init, BOOT_LANE_MAIN,
+		BOOT_DEP(BOOT_SETTINGS) | BOOT_DEP(BOOT_WINGS) |
+		BOOT_DEP(BOOT_IO) | BOOT_DEP(BOOT_ACCEL) |
+		BOOT_DEP(BOOT_PLAYER) | BOOT_DEP(BOOT_RECORD),
+	},
+	[BOOT_DEBUG] = { "debug", debug_init, BOOT_LANE_MAIN },
+};
+
+esp_err_t app_main(void)
+{
+	srand(esp_random());
+	boot_run(boot_phase, BOOT_N);
 	return ESP_OK;
 }
@@ -0,0 +1,89 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+
+#include "boot.h"
+#include "tasks.h"
+
+struct boot_struct
+{
+	EventGroupHandle_t done;
+	const struct boot_phase *phase;
+	int n;
+	int64_t start_us[BOOT_PHASES_MAX];
+	int64_t done_us[BOOT_PHASES_MAX];
+	int64_t ready_us;
+};
+
+static struct boot_struct boot;
+
+static void boot_lane(int lane)
+{
+	int i;
+
+	for (i = 0; i < boot.n; ++i) {
+		const struct boot_phase *p = boot.phase + i;
+
+		if (p->lane != lane)
+			continue;
+		if (p->deps)
+			xEventGroupWaitBits(boot.done, p->deps, pdFALSE, pdTRUE,
+					    portMAX_DELAY);
+		boot.start_us[i] = esp_timer_get_time();
+		p->init();
+		boot.done_us[i] = esp_timer_get_time();
+		ESP_LOGI(__func__, "%s: %" PRId64 " ms, done at %" PRId64 " ms",
+			 p->name, (boot.done_us[i] - boot.start_us[i]) / 1000,
+			 boot.done_us[i] / 1000);
+		xEventGroupSetBits(boot.done, BOOT_DEP(i));
+	}
+}
+
+static void boot_task(void *arg)
+{
+	boot_lane(BOOT_LANE_WORKER);
+	task_exit(TASK_BOOT);
+}
+
+/* Returns when the phases of the main lane are done */
+void boot_run(const struct boot_phase *phase, int n)
+{
+	boot.done = xEventGroupCreate();
+	boot.phase = phase;
+	boot.n = n;
+	task_create(TASK_BOOT, boot_task, NULL);
+	boot_lane(BOOT_LANE_MAIN);
+}
+
+bool boot_done(int phase)
+{
+	return xEventGroupGetBits(boot.done) & BOOT_DEP(phase);
+}
+
+/* Called by the control loop once the turret is searching */
+void boot_ready(void)
+{
+	if (boot.ready_us)
+		return;
+	boot.ready_us = esp_timer_get_time();
+	ESP_LOGI(__func__, "ready at %" PRId64 " ms", boot.ready_us / 1000);
+}
+
+void boot_stat(void)
+{
+	int i;
+
+	printf("%-10s %6s %8s %8s\n", "phase", "lane", "start", "done");
+	for (i = 0; i < boot.n; ++i)
+		printf("%-10s %6s %8" PRId64 " %8" PRId64 "\n",
+		       boot.phase[i].name,
+		       boot.phase[i].lane == BOOT_LANE_MAIN ? "main" : "worker",
+		       boot.start_us[i] / 1000, boot.done_us[i] / 1000);
+	if (boot.ready_us)
+		printf("ready at %" PRId64 " ms\n", boot.ready_us / 1000);
+	else
+		printf("not ready\n");
+}
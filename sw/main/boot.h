@@ -0,0 +1,31 @@
+#ifndef BOOT_H
+#define BOOT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define BOOT_PHASES_MAX		24
+#define BOOT_DEP(phase)		(1u << (phase))
+
+enum {
+	BOOT_LANE_MAIN,		/* app_main */
+	BOOT_LANE_WORKER,	/* TASK_BOOT */
+};
+
+/*
+ * An init step. Phases of one lane run in table order, each one after
+ * the phases in its deps mask are done, on whichever lane they are.
+ */
+struct boot_phase {
+	const char *name;
+	void (*init)(void);
+	int lane;
+	uint32_t deps;
+};
+
+void boot_run(const struct boot_phase *phase, int n);
+bool boot_done(int phase);
+void boot_ready(void);
+void boot_stat(void);
+
+#endif
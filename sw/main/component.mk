@@ -2,3 +2,22 @@
 # "main" pseudo-component makefile.
 #
 # (Uses default behaviour of compiling all source files in directory, adding 'include' to include path.)
+
+COMPONENT_ADD_LDFRAGMENTS += linker.lf
+
+# Fails the build when behaviour.def is inconsistent
+behaviour.stamp: $(COMPONENT_PATH)/behaviour.def $(PROJECT_PATH)/tools/behaviour.py
+	$(PYTHON) $(PROJECT_PATH)/tools/behaviour.py --stamp $@ $<
+
+app_main.o cues.o: behaviour.stamp
+
+# Clip and group IDs, fails the build when a clip has no source
+cue_ids.h: $(COMPONENT_PATH)/behaviour.def $(PROJECT_PATH)/tools/cuegen.py \
+	   $(wildcard $(PROJECT_PATH)/../audio/*/*.mp3)
+	$(PYTHON) $(PROJECT_PATH)/tools/cuegen.py -o $@ $<
+
+app_main.o cues.o guns.o player.o: cue_ids.h
+
+CFLAGS += -I$(COMPONENT_BUILD_DIR)
+
+COMPONENT_EXTRA_CLEAN := behaviour.stamp cue_ids.h
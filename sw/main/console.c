@@ -0,0 +1,185 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_console.h"
+#include "esp_err.h"
+
+#include "accel.h"
+#include "boot.h"
+#include "console.h"
+#include "mem.h"
+#include "player.h"
+#include "power.h"
+#include "record.h"
+#include "tasks.h"
+#include "timing.h"
+#include "trace.h"
+#include "wings.h"
+
+#ifdef CONFIG_TURRET_CONSOLE
+
+static int console_tasks(int argc, char **argv)
+{
+	tasks_stat();
+	printf("audio underruns: %u\n", player_underruns());
+	return 0;
+}
+
+static int console_accel(int argc, char **argv)
+{
+	if (argc > 1 && !strcmp(argv[1], "cal"))
+		accel_calibrate();
+	accel_stat();
+	return 0;
+}
+
+static int console_boot(int argc, char **argv)
+{
+	boot_stat();
+	return 0;
+}
+
+static int console_mem(int argc, char **argv)
+{
+	mem_stat();
+	return 0;
+}
+
+static int console_player(int argc, char **argv)
+{
+	player_stat();
+	return 0;
+}
+
+static int console_wings(int argc, char **argv)
+{
+	wings_stat();
+	return 0;
+}
+
+#ifdef CONFIG_TURRET_IDLE_POWER
+static int console_power(int argc, char **argv)
+{
+	power_stat();
+	return 0;
+}
+#endif
+
+#ifdef CONFIG_TURRET_HOT_PATH_TIMING
+static int console_timing(int argc, char **argv)
+{
+	if (argc > 1 && !strcmp(argv[1], "reset"))
+		timing_reset();
+	else
+		timing_stat();
+	return 0;
+}
+#endif
+
+#ifdef CONFIG_TURRET_TRACE
+static int console_trace(int argc, char **argv)
+{
+	trace_dump();
+	return 0;
+}
+#endif
+
+#ifdef CONFIG_TURRET_RECORD
+static int console_record(int argc, char **argv)
+{
+	record_stat();
+	return 0;
+}
+
+static int console_replay(int argc, char **argv)
+{
+	record_replay(argc > 1 ? atoi(argv[1]) : 1);
+	return 0;
+}
+#endif
+
+static const esp_console_cmd_t console_cmd[] = {
+	{
+		.command = "tasks",
+		.help = "Show per-task CPU use and stack high-water, audio underruns",
+		.func = console_tasks,
+	},
+	{
+		.command = "accel",
+		.help = "Show the accelerometer calibration or recalibrate at rest",
+		.hint = "[cal]",
+		.func = console_accel,
+	},
+	{
+		.command = "boot",
+		.help = "Show boot phase timestamps and the time to ready",
+		.func = console_boot,
+	},
+	{
+		.command = "mem",
+		.help = "Show heap free, low-water and largest block, task stack high-water",
+		.func = console_mem,
+	},
+	{
+		.command = "player",
+		.help = "Show audio underruns and prefetch hit rate",
+		.func = console_player,
+	},
+	{
+		.command = "wings",
+		.help = "Show the learned wing timing and the time saved per opening",
+		.func = console_wings,
+	},
+#ifdef CONFIG_TURRET_IDLE_POWER
+	{
+		.command = "power",
+		.help = "Show idle time, wake to first audio latency and current estimate",
+		.func = console_power,
+	},
+#endif
+#ifdef CONFIG_TURRET_HOT_PATH_TIMING
+	{
+		.command = "timing",
+		.help = "Show or reset hot path execution time statistics",
+		.hint = "[reset]",
+		.func = console_timing,
+	},
+#endif
+#ifdef CONFIG_TURRET_TRACE
+	{
+		.command = "trace",
+		.help = "Dump the event trace, decode with tools/tracedec.py",
+		.func = console_trace,
+	},
+#endif
+#ifdef CONFIG_TURRET_RECORD
+	{
+		.command = "record",
+		.help = "Show the sensor recorder state",
+		.func = console_record,
+	},
+	{
+		.command = "replay",
+		.help = "Restart and replay the n-th newest recorded session",
+		.hint = "[n]",
+		.func = console_replay,
+	},
+#endif
+};
+
+void console_init(void)
+{
+	esp_console_repl_t *repl = NULL;
+	esp_console_repl_config_t repl_config = ESP_CONSOLE_REPL_CONFIG_DEFAULT();
+	esp_console_dev_uart_config_t uart_config = ESP_CONSOLE_DEV_UART_CONFIG_DEFAULT();
+	size_t i;
+
+	repl_config.prompt = "turret>";
+	ESP_ERROR_CHECK(esp_console_new_repl_uart(&uart_config, &repl_config, &repl));
+	esp_console_register_help_command();
+	for (i = 0; i < sizeof(console_cmd) / sizeof(console_cmd[0]); ++i)
+		ESP_ERROR_CHECK(esp_console_cmd_register(console_cmd + i));
+	ESP_ERROR_CHECK(esp_console_start_repl(repl));
+}
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef CONSOLE_H
+#define CONSOLE_H
+
+#include "sdkconfig.h"
+
+#ifdef CONFIG_TURRET_CONSOLE
+void console_init(void);
+#else
+static inline void console_init(void) {}
+#endif
+
+#endif
@@ -0,0 +1,15 @@
+#include "cues.h"
+
+#define CUE_CLIP(clip, path, ms) [clip] = { path, ms },
+const struct cue_clip cue_clip[CLIP_N] = {
+	CUE_CLIPS(CUE_CLIP)
+};
+
+#define CUE_GROUP_CLIPS(group, ...) \
+	static const uint8_t group##_clip[] = { __VA_ARGS__ };
+CUE_GROUPS(CUE_GROUP_CLIPS)
+
+#define CUE_GROUP(group, ...) [group] = { group##_clip, group##_N },
+const struct cue_group cue_group[CUE_N] = {
+	CUE_GROUPS(CUE_GROUP)
+};
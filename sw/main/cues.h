@@ -0,0 +1,22 @@
+#ifndef CUES_H
+#define CUES_H
+
+#include <stdint.h>
+
+/* Clip and group IDs, generated by tools/cuegen.py */
+#include "cue_ids.h"
+
+struct cue_clip {
+	const char *path;
+	uint16_t ms;		/* source duration */
+};
+
+struct cue_group {
+	const uint8_t *clip;
+	int n;
+};
+
+extern const struct cue_clip cue_clip[CLIP_N];
+extern const struct cue_group cue_group[CUE_N];
+
+#endif
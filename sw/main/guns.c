@@ -1,11 +1,11 @@
 #include "driver/gpio.h"
 
+#include "cues.h"
 #include "guns.h"
+#include "head.h"
+#include "latency.h"
 #include "player.h"
 
-#define GPIO_LGUNS	12
-#define GPIO_RGUNS	13
-
 #define TICKS_GUN_ON		4
 #define TICKS_GUN_OFF		3
 #define TICKS_BURST_PAUSE	22
@@ -32,7 +32,7 @@ struct guns_struct {
 	struct gun_struct gun[2];
 };
 
-static struct guns_struct guns;
+static struct guns_struct guns[HEADS];
 
 static void gun_reset(struct gun_struct *gun)
 {
@@ -71,8 +71,13 @@ static void gun_tick(struct gun_struct *gun)
 		break;
 	}
 
-	if (gun->tick == 0)
+	if (gun->tick == 0) {
+		if (gun->state == STATE_GUN_ON) {
+			latency_response(LATENCY_GPIO);
+			latency_response(LATENCY_SHOT);
+		}
 		gpio_set_level(gun->gpio, gun->state == STATE_GUN_ON);
+	}
 }
 
 void guns_init(void)
@@ -80,41 +85,64 @@ void guns_init(void)
 	gpio_config_t io_conf = {
 		.intr_type = GPIO_INTR_DISABLE,
 		.mode = GPIO_MODE_OUTPUT,
-		.pin_bit_mask = (1 << GPIO_LGUNS) | (1 << GPIO_RGUNS),
 	};
+	int i;
+
+	for (i = 0; i < HEADS; ++i) {
+		io_conf.pin_bit_mask |= 1ULL << head_config[i].lguns |
+			1ULL << head_config[i].rguns;
+		guns[i].gun[0].gpio = head_config[i].lguns;
+		guns[i].gun[1].gpio = head_config[i].rguns;
+	}
 	gpio_config(&io_conf);
+}
 
-	guns.gun[0].gpio = GPIO_LGUNS;
-	guns.gun[1].gpio = GPIO_RGUNS;
+struct guns_struct *guns_head(int head)
+{
+	return guns + head;
 }
 
-void guns_fire(bool on)
+static void guns_close_stream(struct guns_struct *g)
+{
+	if (g->stream) {
+		player_close_stream(g->stream);
+		g->stream = NULL;
+	}
+}
+
+/* Loops the firing sound, a clip that fails to open is retried next tick */
+static void guns_play(struct guns_struct *g)
+{
+	if (g->stream && player_is_playing(g->stream))
+		return;
+	guns_close_stream(g);
+	g->stream = player_play_id(cue_group[CUE_FIRING].clip[0]);
+}
+
+void guns_fire(struct guns_struct *g, bool on)
 {
 	bool reset = false;
 
-	if (on && guns.state != STATE_FIRE) {
-		guns.state = STATE_FIRE;
-		guns.stream = player_play("/audio/09/007_turret_firex3.mp3.s8");
+	if (on && g->state != STATE_FIRE) {
+		g->state = STATE_FIRE;
+		guns_play(g);
 		reset = true;
-	} else if (!on && guns.state == STATE_FIRE) {
-		guns.state = STATE_OFF;
-		player_close_stream(guns.stream);
+	} else if (!on && g->state == STATE_FIRE) {
+		g->state = STATE_OFF;
+		guns_close_stream(g);
 		reset = true;
 	}
 	if (reset) {
-		gun_reset(guns.gun);
-		gun_reset(guns.gun + 1);
+		gun_reset(g->gun);
+		gun_reset(g->gun + 1);
 	}
 }
 
-void guns_tick(void)
+void guns_tick(struct guns_struct *g)
 {
-	if (guns.state == STATE_FIRE) {
-		gun_tick(guns.gun);
-		gun_tick(guns.gun + 1);
-		if (!player_is_playing(guns.stream)) {
-			player_close_stream(guns.stream);
-			guns.stream = player_play("/audio/09/007_turret_firex3.mp3.s8");
-		}
+	if (g->state == STATE_FIRE) {
+		gun_tick(g->gun);
+		gun_tick(g->gun + 1);
+		guns_play(g);
 	}
 }
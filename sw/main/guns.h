@@ -1,8 +1,13 @@
 #ifndef GUNS_H
 #define GUNS_H
 
+#include <stdbool.h>
+
+struct guns_struct;
+
 void guns_init(void);
-void guns_fire(bool on);
-void guns_tick(void);
+struct guns_struct *guns_head(int head);
+void guns_fire(struct guns_struct *g, bool on);
+void guns_tick(struct guns_struct *g);
 
 #endif
@@ -0,0 +1,32 @@
+#include "head.h"
+
+/*
+ * The first head keeps the pins of the single head board. The second
+ * one has its PIR on an input only pin and its ADXL345 SDO pulled low.
+ */
+const struct head_config head_config[HEADS] = {
+	{
+		.pir = 22,
+		.laser = 14,
+		.lguns = 12,
+		.rguns = 13,
+		.end_switch = 23,
+		.wingspan = 32,
+		.wingturn = 33,
+		.pwm = MCPWM_UNIT_0,
+		.accel_addr = 0x1d,
+	},
+#if HEADS > 1
+	{
+		.pir = 34,
+		.laser = 4,
+		.lguns = 16,
+		.rguns = 17,
+		.end_switch = 5,
+		.wingspan = 18,
+		.wingturn = 27,
+		.pwm = MCPWM_UNIT_1,
+		.accel_addr = 0x53,
+	},
+#endif
+};
@@ -0,0 +1,26 @@
+#ifndef HEAD_H
+#define HEAD_H
+
+#include <stdint.h>
+#include "driver/gpio.h"
+#include "driver/mcpwm.h"
+#include "sdkconfig.h"
+
+#define HEADS		CONFIG_TURRET_HEADS
+
+/* Pins and bus addresses of one turret head */
+struct head_config {
+	gpio_num_t pir;
+	gpio_num_t laser;
+	gpio_num_t lguns;
+	gpio_num_t rguns;
+	gpio_num_t end_switch;
+	gpio_num_t wingspan;
+	gpio_num_t wingturn;
+	mcpwm_unit_t pwm;	/* wingspan on timer 0, wingturn on timer 1 */
+	uint8_t accel_addr;	/* ADXL345 on the shared I2C bus */
+};
+
+extern const struct head_config head_config[HEADS];
+
+#endif
@@ -0,0 +1,392 @@
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_random.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "latency.h"
+#include "mem.h"
+#include "player.h"
+#include "record.h"
+#include "tasks.h"
+
+#ifdef CONFIG_TURRET_LATENCY_BENCH
+
+#define LATENCY_RUNS		CONFIG_TURRET_LATENCY_BENCH_RUNS
+#define LATENCY_SETTLE_MS	2000
+#define LATENCY_POLL_MS		100
+#define LATENCY_JITTER_MS	1000
+#define LATENCY_ACCEL_OFFSET	100
+/* Enough to tilt the long average past either uneven threshold */
+#define LATENCY_FALL_OFFSET	300
+
+#define LATENCY_NONE		(-1)
+
+#ifdef CONFIG_TURRET_SOAK
+#define LATENCY_SOAK		1
+#else
+#define LATENCY_SOAK		0
+#endif
+
+/*
+ * Control tick time histogram, the last bin counts everything above.
+ * A tick is mostly I2C time, the code varies it by a few us only.
+ */
+#define SOAK_TICK_BIN_US	1
+#define SOAK_TICK_BINS		1024
+/* Heap the IDF and FAT may take for themselves over a window */
+#define SOAK_HEAP_SLACK		2048
+
+/* Taken at idle after each window */
+struct latency_soak_sample
+{
+	size_t free;
+	size_t largest;
+	size_t player;
+	unsigned streams;
+	unsigned files;
+	int tick_p50_us;
+	int tick_p99_us;
+};
+
+struct latency_struct
+{
+	portMUX_TYPE mux;
+	volatile bool idle;
+	volatile int stimulus;
+	int64_t stimulus_time;
+	volatile unsigned pending;
+	int run[LATENCY_STIMULUS_N];
+	int32_t sample[LATENCY_STIMULUS_N][LATENCY_RESPONSE_N][LATENCY_RUNS];
+#ifdef CONFIG_TURRET_SOAK
+	/* Counted by the control task, cleared between windows */
+	volatile uint32_t tick_bin[SOAK_TICK_BINS];
+	volatile uint32_t tick_max_us;
+	int window;
+	unsigned underruns;
+	struct latency_soak_sample base;
+#endif
+};
+
+static struct latency_struct latency = {
+	.mux = portMUX_INITIALIZER_UNLOCKED,
+	.stimulus = LATENCY_NONE,
+};
+
+static const char * const latency_stimulus_name[LATENCY_STIMULUS_N] = {
+	[LATENCY_STIMULUS_PIR] = "pir",
+	[LATENCY_STIMULUS_PICKUP] = "pickup",
+	[LATENCY_STIMULUS_FALL] = "fall",
+};
+
+static const char * const latency_response_name[LATENCY_RESPONSE_N] = {
+	[LATENCY_GPIO] = "gpio",
+	[LATENCY_AUDIO] = "audio",
+	[LATENCY_SERVO] = "servo",
+	[LATENCY_SHOT] = "shot",
+};
+
+/* How long a stimulus is held before the next one may be injected */
+static const int latency_hold_ms[LATENCY_STIMULUS_N] = {
+	[LATENCY_STIMULUS_PIR] = 3000,
+	[LATENCY_STIMULUS_PICKUP] = 2000,
+	[LATENCY_STIMULUS_FALL] = 5000,
+};
+
+/*
+ * p99 budgets in ms, 0 -- not checked. PIR to the first shot includes
+ * the wing opening, which outlasts the alert clip. Pickup responses include the accelerometer averaging
+ * window. Falls are not checked, they only exercise the tipped path.
+ * Update when behaviour changes on purpose.
+ */
+static const int latency_budget_ms[LATENCY_STIMULUS_N][LATENCY_RESPONSE_N] = {
+	[LATENCY_STIMULUS_PIR] = {
+		[LATENCY_GPIO] = 4000,
+		[LATENCY_AUDIO] = 150,
+		[LATENCY_SERVO] = 50,
+		[LATENCY_SHOT] = 4000,
+	},
+	[LATENCY_STIMULUS_PICKUP] = {
+		[LATENCY_GPIO] = 1000,
+		[LATENCY_AUDIO] = 1200,
+	},
+};
+
+static void latency_wait_idle(void)
+{
+	int ms = 0;
+
+	while (ms < LATENCY_SETTLE_MS) {
+		vTaskDelay(pdMS_TO_TICKS(LATENCY_POLL_MS));
+		if (latency.idle)
+			ms += LATENCY_POLL_MS;
+		else
+			ms = 0;
+	}
+}
+
+static void latency_inject(int stimulus)
+{
+	int i;
+
+	for (i = 0; i < LATENCY_RESPONSE_N; ++i)
+		latency.sample[stimulus][i][latency.run[stimulus]] = LATENCY_NONE;
+
+	portENTER_CRITICAL(&latency.mux);
+	latency.stimulus_time = esp_timer_get_time();
+	latency.pending = (1 << LATENCY_RESPONSE_N) - 1;
+	latency.stimulus = stimulus;
+	portEXIT_CRITICAL(&latency.mux);
+}
+
+static void latency_release(int stimulus)
+{
+	portENTER_CRITICAL(&latency.mux);
+	latency.stimulus = LATENCY_NONE;
+	latency.pending = 0;
+	portEXIT_CRITICAL(&latency.mux);
+	++latency.run[stimulus];
+}
+
+static int latency_compare(const void *a, const void *b)
+{
+	int32_t x = *(const int32_t *)a;
+	int32_t y = *(const int32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static bool latency_report(void)
+{
+	bool pass = true;
+	int s, r, i;
+
+	for (s = 0; s < LATENCY_STIMULUS_N; ++s) {
+		for (r = 0; r < LATENCY_RESPONSE_N; ++r) {
+			int32_t v[LATENCY_RUNS];
+			int budget = latency_budget_ms[s][r];
+			int n = 0;
+			int32_t p99;
+
+			for (i = 0; i < latency.run[s]; ++i)
+				if (latency.sample[s][r][i] != LATENCY_NONE)
+					v[n++] = latency.sample[s][r][i];
+
+			if (!n) {
+				ESP_LOGI(__func__, "%s -> %s: no response",
+					 latency_stimulus_name[s],
+					 latency_response_name[r]);
+				if (budget)
+					pass = false;
+				continue;
+			}
+			qsort(v, n, sizeof(v[0]), latency_compare);
+			p99 = v[n * 99 / 100];
+			ESP_LOGI(__func__, "%s -> %s: n = %d, p50 = %" PRId32 ".%03" PRId32 " ms, p99 = %" PRId32 ".%03" PRId32 " ms, max = %" PRId32 ".%03" PRId32 " ms",
+				 latency_stimulus_name[s], latency_response_name[r], n,
+				 v[n / 2] / 1000, v[n / 2] % 1000,
+				 p99 / 1000, p99 % 1000,
+				 v[n - 1] / 1000, v[n - 1] % 1000);
+			if (budget && (n < latency.run[s] || p99 > budget * 1000)) {
+				ESP_LOGE(__func__, "%s -> %s: over budget of %d ms or missed %d responses",
+					 latency_stimulus_name[s], latency_response_name[r],
+					 budget, latency.run[s] - n);
+				pass = false;
+			}
+		}
+	}
+	ESP_LOGI(__func__, "%s", pass ? "PASS" : "FAIL");
+	return pass;
+}
+
+#ifdef CONFIG_TURRET_SOAK
+/* Upper edge of the bin holding the pct-th percentile of control ticks */
+static int latency_tick_percentile(uint32_t n, int pct)
+{
+	uint32_t sum = 0;
+	int i;
+
+	for (i = 0; i < SOAK_TICK_BINS - 1; ++i) {
+		sum += latency.tick_bin[i];
+		if (sum * 100 >= (uint64_t)n * pct)
+			break;
+	}
+	return (i + 1) * SOAK_TICK_BIN_US;
+}
+
+static void latency_soak_sample(struct latency_soak_sample *s)
+{
+	struct mem_info info;
+	uint32_t n = 0;
+	int i;
+
+	mem_get(&info);
+	s->free = info.free;
+	s->largest = info.largest;
+	s->player = player_heap();
+	player_count(&s->streams, &s->files);
+	for (i = 0; i < SOAK_TICK_BINS; ++i)
+		n += latency.tick_bin[i];
+	s->tick_p50_us = latency_tick_percentile(n, 50);
+	s->tick_p99_us = latency_tick_percentile(n, 99);
+}
+
+/*
+ * Compare the idle state after a window to the first one. Streams and
+ * files must all be closed, the player must hold no more than it did,
+ * the heap may only move by the slack and the p99 tick time by half.
+ */
+static bool latency_soak(void)
+{
+	struct latency_soak_sample s;
+	const struct latency_soak_sample *b = &latency.base;
+	unsigned underruns = player_underruns();
+	bool pass = true;
+
+	latency_wait_idle();
+	latency_soak_sample(&s);
+	if (!latency.window)
+		latency.base = s;
+
+	ESP_LOGI(__func__, "window %d: heap %u free, %u largest, player %u, %u streams, %u files, tick p50 = %d us, p99 = %d us, max = %" PRIu32 " us, %u underruns",
+		 latency.window, (unsigned)s.free, (unsigned)s.largest,
+		 (unsigned)s.player, s.streams, s.files, s.tick_p50_us,
+		 s.tick_p99_us, latency.tick_max_us,
+		 underruns - latency.underruns);
+
+	if (s.streams || s.files) {
+		ESP_LOGE(__func__, "%u streams and %u files left open at idle",
+			 s.streams, s.files);
+		pass = false;
+	}
+	if (s.player > b->player) {
+		ESP_LOGE(__func__, "player heap grew from %u to %u",
+			 (unsigned)b->player, (unsigned)s.player);
+		pass = false;
+	}
+	if (s.free + SOAK_HEAP_SLACK < b->free ||
+	    s.largest + SOAK_HEAP_SLACK < b->largest) {
+		ESP_LOGE(__func__, "heap shrank from %u free, %u largest",
+			 (unsigned)b->free, (unsigned)b->largest);
+		pass = false;
+	}
+	if (s.tick_p99_us > b->tick_p99_us * 3 / 2 + SOAK_TICK_BIN_US) {
+		ESP_LOGE(__func__, "tick p99 drifted from %d us",
+			 b->tick_p99_us);
+		pass = false;
+	}
+
+	memset((void *)latency.tick_bin, 0, sizeof(latency.tick_bin));
+	latency.tick_max_us = 0;
+	latency.underruns = underruns;
+	++latency.window;
+	ESP_LOGI(__func__, "%s", pass ? "PASS" : "FAIL");
+	return pass;
+}
+#else
+static bool latency_soak(void)
+{
+	return true;
+}
+#endif
+
+/* In a soak, windows are repeated until one fails */
+static void latency_task(void *arg)
+{
+	bool pass;
+	int i, s;
+
+	do {
+		for (s = 0; s < LATENCY_STIMULUS_N; ++s)
+			latency.run[s] = 0;
+		for (i = 0; i < LATENCY_RUNS; ++i) {
+			for (s = 0; s < LATENCY_STIMULUS_N; ++s) {
+				latency_wait_idle();
+				vTaskDelay(pdMS_TO_TICKS(esp_random() % LATENCY_JITTER_MS));
+				latency_inject(s);
+				vTaskDelay(pdMS_TO_TICKS(latency_hold_ms[s]));
+				latency_release(s);
+			}
+		}
+		pass = latency_report();
+		pass = latency_soak() && pass;
+	} while (LATENCY_SOAK && pass);
+	task_exit(TASK_LATENCY);
+}
+
+/* A replay takes its inputs from the recording, injections would be lost */
+void latency_init(void)
+{
+	if (!record_replaying())
+		task_create(TASK_LATENCY, latency_task, NULL);
+}
+
+/* Called by the control loop: the turret is ready for the next stimulus */
+void latency_idle(bool idle)
+{
+	latency.idle = idle;
+}
+
+bool latency_inject_pir(void)
+{
+	return latency.stimulus == LATENCY_STIMULUS_PIR;
+}
+
+/* Offset added to the accelerometer X axis to simulate a pickup or fall */
+int latency_inject_accel(void)
+{
+	switch (latency.stimulus) {
+	case LATENCY_STIMULUS_PICKUP:
+		return LATENCY_ACCEL_OFFSET;
+	case LATENCY_STIMULUS_FALL:
+		return LATENCY_FALL_OFFSET;
+	default:
+		return 0;
+	}
+}
+
+bool latency_pending(int response)
+{
+	return latency.pending & (1 << response);
+}
+
+/* Record the first response of each kind after the current stimulus */
+void latency_response(int response)
+{
+	int64_t now;
+
+	if (!latency_pending(response))
+		return;
+
+	now = esp_timer_get_time();
+	portENTER_CRITICAL(&latency.mux);
+	if (latency.pending & (1 << response)) {
+		latency.pending &= ~(1 << response);
+		latency.sample[latency.stimulus][response][latency.run[latency.stimulus]] =
+			now - latency.stimulus_time;
+	}
+	portEXIT_CRITICAL(&latency.mux);
+}
+
+#ifdef CONFIG_TURRET_SOAK
+int64_t latency_tick_begin(void)
+{
+	return esp_timer_get_time();
+}
+
+/* Called by the control task after each tick */
+void latency_tick_end(int64_t begin)
+{
+	uint32_t us = esp_timer_get_time() - begin;
+	int bin = us / SOAK_TICK_BIN_US;
+
+	++latency.tick_bin[bin < SOAK_TICK_BINS ? bin : SOAK_TICK_BINS - 1];
+	if (us > latency.tick_max_us)
+		latency.tick_max_us = us;
+}
+#endif
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "sdkconfig.h"
+
+enum {
+	LATENCY_STIMULUS_PIR,
+	LATENCY_STIMULUS_PICKUP,
+	LATENCY_STIMULUS_FALL,
+	LATENCY_STIMULUS_N,
+};
+
+enum {
+	LATENCY_GPIO,
+	LATENCY_AUDIO,
+	LATENCY_SERVO,
+	LATENCY_SHOT,
+	LATENCY_RESPONSE_N,
+};
+
+#ifdef CONFIG_TURRET_LATENCY_BENCH
+void latency_init(void);
+void latency_idle(bool idle);
+bool latency_inject_pir(void);
+int latency_inject_accel(void);
+bool latency_pending(int response);
+void latency_response(int response);
+#else
+static inline void latency_init(void) {}
+static inline void latency_idle(bool idle) {}
+static inline bool latency_inject_pir(void) { return false; }
+static inline int latency_inject_accel(void) { return 0; }
+static inline bool latency_pending(int response) { return false; }
+static inline void latency_response(int response) {}
+#endif
+
+#ifdef CONFIG_TURRET_SOAK
+int64_t latency_tick_begin(void);
+void latency_tick_end(int64_t begin);
+#else
+static inline int64_t latency_tick_begin(void) { return 0; }
+static inline void latency_tick_end(int64_t begin) {}
+#endif
+
+#endif
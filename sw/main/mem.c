@@ -0,0 +1,67 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+
+#include "mem.h"
+#include "player.h"
+#include "tasks.h"
+
+/* The largest free block has no low-water mark of its own */
+#define MEM_SAMPLE_US	(10 * 1000000)
+
+struct mem_struct
+{
+	esp_timer_handle_t timer;
+	size_t min_largest;
+};
+
+static struct mem_struct mem;
+
+static void mem_sample(void *arg)
+{
+	size_t largest = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+
+	if (!mem.min_largest || largest < mem.min_largest)
+		mem.min_largest = largest;
+}
+
+void mem_init(void)
+{
+	const esp_timer_create_args_t args = {
+		.callback = mem_sample,
+		.name = "mem_sample",
+		.skip_unhandled_events = true,
+	};
+
+	mem_sample(NULL);
+	if (esp_timer_create(&args, &mem.timer) == ESP_OK)
+		esp_timer_start_periodic(mem.timer, MEM_SAMPLE_US);
+}
+
+void mem_get(struct mem_info *info)
+{
+	mem_sample(NULL);
+	info->free = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+	info->min_free = heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);
+	info->largest = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+	info->min_largest = mem.min_largest;
+	info->dma_free = heap_caps_get_free_size(MALLOC_CAP_DMA);
+	info->dma_largest = heap_caps_get_largest_free_block(MALLOC_CAP_DMA);
+}
+
+void mem_stat(void)
+{
+	struct mem_info info;
+
+	mem_get(&info);
+	printf("uptime: %" PRId64 " s\n", esp_timer_get_time() / 1000000);
+	printf("heap: %u free, %u min free, %u largest block, %u min largest block\n",
+	       (unsigned)info.free, (unsigned)info.min_free,
+	       (unsigned)info.largest, (unsigned)info.min_largest);
+	printf("dma heap: %u free, %u largest block\n",
+	       (unsigned)info.dma_free, (unsigned)info.dma_largest);
+	printf("player: %u bytes in streams and mix buffer\n",
+	       (unsigned)player_heap());
+	tasks_stack_stat();
+}
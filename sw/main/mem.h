@@ -0,0 +1,21 @@
+#ifndef MEM_H
+#define MEM_H
+
+#include <stddef.h>
+
+struct mem_info {
+	size_t free;
+	size_t min_free;
+	size_t largest;
+	/* Smallest largest free block seen, grows apart from min_free
+	 * when the heap fragments */
+	size_t min_largest;
+	size_t dma_free;
+	size_t dma_largest;
+};
+
+void mem_init(void);
+void mem_get(struct mem_info *info);
+void mem_stat(void);
+
+#endif
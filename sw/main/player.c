@@ -1,19 +1,31 @@
+#include <inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
 #include "freertos/semphr.h"
 #include "freertos/task.h"
 #include "esp_err.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "driver/i2s.h"
 
+#include "cues.h"
+#include "latency.h"
 #include "player.h"
+#include "power.h"
+#include "tasks.h"
+#include "timing.h"
+#include "trace.h"
 
 /*---------------------------------------------------------------
   EXAMPLE CONFIG
   ---------------------------------------------------------------*/
-#define PLAYER_PERIOD_SIZE	(1024)
-#define PLAYER_I2S_PERIOD_SIZE	(2 * PLAYER_PERIOD_SIZE)
+/* Frames read from a clip at once, and staged ahead of a play */
+#define PLAYER_CHUNK_SIZE	(1024)
+/* Frames of one DMA buffer, a chunk is mixed in whole periods */
+#define PLAYER_PERIOD_SIZE	(256)
 //i2s number
 #define PLAYER_I2S_NUM		(0)
 //i2s sample rate
@@ -21,9 +33,29 @@
 //i2s data bits
 #define PLAYER_I2S_SAMPLE_BITS	(16)
 //I2S data format
+#ifdef CONFIG_TURRET_AUDIO_MONO
+#define PLAYER_I2S_FORMAT	(I2S_CHANNEL_FMT_ONLY_RIGHT)
+#define PLAYER_I2S_DAC_MODE	(I2S_DAC_CHANNEL_RIGHT_EN)
+#else
 #define PLAYER_I2S_FORMAT	(I2S_CHANNEL_FMT_RIGHT_LEFT)
-//I2S channel number
+#define PLAYER_I2S_DAC_MODE	(I2S_DAC_CHANNEL_BOTH_EN)
+#endif
+//I2S channel number, every sample goes to each of them
 #define PLAYER_I2S_CHANNEL_NUM	((PLAYER_I2S_FORMAT < I2S_CHANNEL_FMT_ONLY_RIGHT) ? (2) : (1))
+//bytes of one mixed period, one frame per sample, before expansion
+#define PLAYER_MIX_SIZE		(PLAYER_PERIOD_SIZE * PLAYER_I2S_CHANNEL_NUM)
+
+#define PLAYER_I2S_DMA_BUFS	(2)
+#define PLAYER_I2S_QUEUE_SIZE	(PLAYER_I2S_DMA_BUFS * 2)
+//longest wait for a DMA buffer, several periods
+#define PLAYER_I2S_WAIT_MS	(100)
+
+#define PLAYER_PREFETCH_SLOTS	CONFIG_TURRET_PREFETCH_SLOTS
+#define PLAYER_NO_CLIP		(-1)
+/* A clip that failed to stage is tried again after */
+#define PLAYER_PREFETCH_RETRY_MS	(500)
+/* A failed reopen is tried again well within a chunk */
+#define PLAYER_REOPEN_RETRY_MS		(10)
 
 #define PLAYER_LOGIC_MIN	(-128)
 #define PLAYER_LOGIC_MAX	(127)
@@ -35,7 +67,7 @@
 /**
  * @brief I2S DAC mode init.
  */
-static void player_i2s_init(void)
+static void player_i2s_init(QueueHandle_t *queue)
 {
 	int i2s_num = PLAYER_I2S_NUM;
 	i2s_config_t i2s_config = {
@@ -45,40 +77,63 @@ static void player_i2s_init(void)
 		.communication_format = I2S_COMM_FORMAT_STAND_MSB,
 		.channel_format = PLAYER_I2S_FORMAT,
 		.intr_alloc_flags = 0,
-		.dma_buf_count = 2,
-		.dma_buf_len = 256,
+		/* One period plays while the next one waits in the other buffer */
+		.dma_buf_count = PLAYER_I2S_DMA_BUFS,
+		.dma_buf_len = PLAYER_PERIOD_SIZE,
 		.use_apll = 1,
 	};
 	//install and start i2s driver
-	i2s_driver_install(i2s_num, &i2s_config, 0, NULL);
+	i2s_driver_install(i2s_num, &i2s_config, PLAYER_I2S_QUEUE_SIZE, queue);
 	//init DAC pad
-	i2s_set_dac_mode(I2S_DAC_CHANNEL_BOTH_EN);
+	i2s_set_dac_mode(PLAYER_I2S_DAC_MODE);
 }
 
+/*
+ * Only the top 8 bits of an I2S sample reach the DAC, so periods are
+ * mixed as 8-bit DAC values and expanded by i2s_write_expand while
+ * they are copied into the DMA buffer. In stereo both DACs get the
+ * same value, a frame holds one sample in either mode.
+ */
 static int player_i2s_dac_sample_scale(uint8_t *buf, int sample)
 {
+	int i;
+
 	sample = (PLAYER_MASTER_VOLUME * sample) / PLAYER_MASTER_RANGE +
 		PLAYER_MASTER_OFFSET;
-#if (PLAYER_I2S_SAMPLE_BITS == 16)
-	buf[0] = 0;
-	buf[1] = sample;
-	return 2;
-#else
-	buf[0] = 0;
-	buf[1] = 0;
-	buf[2] = 0;
-	buf[3] = sample;
-	return 4;
-#endif
+	for (i = 0; i < PLAYER_I2S_CHANNEL_NUM; ++i)
+		buf[i] = sample;
+	return PLAYER_I2S_CHANNEL_NUM;
 }
 
 struct player_stream_struct
 {
 	struct player_stream_struct *next;
+	int clip;
 	int offset;
 	int size;
+	/* NULL for a staged stream until prefetch_task reopens it */
 	FILE *file;
-	int8_t buf[PLAYER_PERIOD_SIZE];
+	/* buf already holds the next chunk */
+	bool primed;
+	/* Time it took to open the file and read the first chunk */
+	int32_t stage_us;
+	int8_t buf[PLAYER_CHUNK_SIZE];
+};
+
+/*
+ * Streams staged ahead of player_play_id. Files are closed after the first
+ * chunk is read so that staging does not run out of FAT file handles, and
+ * reopened by prefetch_task once the stream plays.
+ */
+struct player_prefetch_struct
+{
+	int clip[PLAYER_PREFETCH_SLOTS];
+	struct player_stream_struct *stream[PLAYER_PREFETCH_SLOTS];
+	TaskHandle_t task;
+	unsigned hits;
+	unsigned misses;
+	unsigned unpredicted;
+	int64_t saved_us;
 };
 
 struct player_struct
@@ -89,6 +144,21 @@ struct player_struct
 	} state;
 	struct player_stream_struct *stream;
 	SemaphoreHandle_t lock;
+	TaskHandle_t task;
+	QueueHandle_t i2s_queue;
+	/* DMA buffers known to be played out and free for the next period */
+	int dma_free;
+	unsigned underruns;
+	/* Bytes of streams allocated, playing or staged */
+	size_t heap;
+	/* Files open for streams */
+	unsigned files;
+	/* How long mixed periods waited for a free DMA buffer */
+	unsigned periods;
+	unsigned late;
+	int32_t margin_min_us;
+	int64_t margin_sum_us;
+	struct player_prefetch_struct prefetch;
 };
 
 static struct player_struct player;
@@ -116,8 +186,27 @@ static bool player_fill_streams(struct player_stream_struct *stream)
 	bool active = false;
 
 	while (stream) {
-		if (fread(stream->buf, 1, sizeof(stream->buf), stream->file))
+		if (stream->offset % PLAYER_CHUNK_SIZE) {
+			/* buf holds the rest of the chunk */
+			active |= stream->offset < stream->size;
+		} else if (stream->primed) {
+			stream->primed = false;
 			active = true;
+		} else {
+			if (stream->file &&
+			    fread(stream->buf, 1, sizeof(stream->buf), stream->file)) {
+				active = true;
+			} else if (stream->offset < stream->size) {
+				/*
+				 * The staged stream is not reopened yet, buf
+				 * still holds its first chunk. Play a silent
+				 * one instead and skip it in the file.
+				 */
+				memset(stream->buf, 0, sizeof(stream->buf));
+				++player.underruns;
+				active = true;
+			}
+		}
 		stream = stream->next;
 	}
 	return active;
@@ -146,7 +235,7 @@ static int player_mix(uint8_t *buf, struct player_stream_struct *stm)
 			int offset = stream->offset + i;
 
 			if (offset < stream->size)
-				v += stream->buf[i];
+				v += stream->buf[offset % PLAYER_CHUNK_SIZE];
 		}
 		if (v > PLAYER_LOGIC_MAX)
 			v = PLAYER_LOGIC_MAX;
@@ -168,17 +257,105 @@ static int player_mix(uint8_t *buf, struct player_stream_struct *stm)
 	return off;
 }
 
+/* Whether a mixed period carries anything but the DAC bias level */
+static bool player_audible(const uint8_t *buf, int len)
+{
+	uint8_t bias[PLAYER_I2S_CHANNEL_NUM];
+	int i;
+
+	player_i2s_dac_sample_scale(bias, -PLAYER_LOGIC_MIN);
+	for (i = 0; i < len; ++i)
+		if (buf[i] != bias[0])
+			return true;
+	return false;
+}
+
+/*
+ * The driver reports TX queue overflow when the DMA has played out all
+ * buffers and starts repeating stale data, i.e. an underrun. Returns
+ * whether that happened.
+ */
+static bool player_dma_event(struct player_struct *player,
+			     const i2s_event_t *event)
+{
+	if (event->type == I2S_EVENT_TX_DONE) {
+		if (player->dma_free < PLAYER_I2S_DMA_BUFS)
+			++player->dma_free;
+	} else if (event->type == I2S_EVENT_TX_Q_OVF) {
+		++player->underruns;
+		trace_event(TRACE_I2S_UNDERRUN, 0);
+		return true;
+	}
+	return false;
+}
+
+/*
+ * Wait for the DMA to finish the buffer of one period. A period is
+ * late when the DMA ran dry before it was mixed: every buffer was
+ * already played out, or the driver reported an overflow.
+ */
+static void player_wait_dma(struct player_struct *player)
+{
+	int64_t start = esp_timer_get_time();
+	int32_t margin;
+	i2s_event_t event;
+	bool late = false;
+
+	while (xQueueReceive(player->i2s_queue, &event, 0) == pdTRUE)
+		late |= player_dma_event(player, &event);
+	late |= player->dma_free == PLAYER_I2S_DMA_BUFS;
+	while (!player->dma_free &&
+	       xQueueReceive(player->i2s_queue, &event,
+			     pdMS_TO_TICKS(PLAYER_I2S_WAIT_MS)) == pdTRUE)
+		late |= player_dma_event(player, &event);
+	if (player->dma_free)
+		--player->dma_free;
+
+	margin = esp_timer_get_time() - start;
+	if (!player->periods || margin < player->margin_min_us)
+		player->margin_min_us = margin;
+	player->margin_sum_us += margin;
+	++player->periods;
+	if (late)
+		++player->late;
+}
+
+/*
+ * The ramps are tables of 16-bit DAC samples, one per frame. They go
+ * through the mix buffer a period at a time, so that stereo frames get
+ * them on both DACs.
+ */
+static void player_write_ramp(uint8_t *buf, const uint8_t *ramp, size_t size)
+{
+	size_t bytes_written;
+	int i, c, n = 0;
+
+	for (i = 1; i < size; i += 2) {
+		for (c = 0; c < PLAYER_I2S_CHANNEL_NUM; ++c)
+			buf[n++] = ramp[i];
+		if (n == PLAYER_MIX_SIZE || i + 2 >= size) {
+			i2s_write_expand(PLAYER_I2S_NUM, buf, n, 8,
+					 PLAYER_I2S_SAMPLE_BITS,
+					 &bytes_written, portMAX_DELAY);
+			trace_event(TRACE_I2S_WRITE, bytes_written);
+			n = 0;
+		}
+	}
+}
+
 static void player_task(void *arg)
 {
 	struct player_struct *player = arg;
-	uint8_t* i2s_write_buff = malloc(PLAYER_I2S_PERIOD_SIZE);
+	uint8_t *buf = malloc(PLAYER_MIX_SIZE);
 
 	i2s_set_clk(PLAYER_I2S_NUM, PLAYER_I2S_SAMPLE_RATE,
-		    PLAYER_I2S_SAMPLE_BITS, 1);
+		    PLAYER_I2S_SAMPLE_BITS, PLAYER_I2S_CHANNEL_NUM);
+	/* Started on demand when leaving STATE_SILENT */
+	i2s_stop(PLAYER_I2S_NUM);
 
 	for (;;) {
 		size_t bytes_written;
-		int i2s_write_len;
+		int len, i;
 		bool active;
 
 		player_lock(player);
@@ -188,74 +365,327 @@ static void player_task(void *arg)
 			active = player_active_streams(player->stream);
 			player_unlock(player);
 			if (active) {
-				i2s_write(PLAYER_I2S_NUM,
-					  i2s_ramp_up_buff, sizeof(i2s_ramp_up_buff),
-					  &bytes_written, portMAX_DELAY);
+				power_audio_started();
+				i2s_start(PLAYER_I2S_NUM);
+				player_write_ramp(buf, i2s_ramp_up_buff,
+						  sizeof(i2s_ramp_up_buff));
+				/* Pace the first period by the next TX done event */
+				xQueueReset(player->i2s_queue);
+				player->dma_free = 0;
 				player->state = STATE_PLAYING;
 			} else {
-				vTaskDelay(10 / portTICK_PERIOD_MS);
+				ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
 			}
 			break;
 
 		case STATE_PLAYING:
+			/* Mix the next period while the DMA plays the current one */
 			if (player_fill_streams(player->stream)) {
-				i2s_write_len = player_mix(i2s_write_buff, player->stream);
+				uint32_t t = timing_begin();
+
+				len = player_mix(buf, player->stream);
+				timing_end(TIMING_PLAYER_MIX, t);
 				player_unlock(player);
-				i2s_write(PLAYER_I2S_NUM, i2s_write_buff, i2s_write_len,
-					  &bytes_written, portMAX_DELAY);
+				player_wait_dma(player);
+				i2s_write_expand(PLAYER_I2S_NUM, buf, len,
+						 8, PLAYER_I2S_SAMPLE_BITS,
+						 &bytes_written, portMAX_DELAY);
+				trace_event(TRACE_I2S_WRITE, bytes_written);
+				if (latency_pending(LATENCY_AUDIO) &&
+				    player_audible(buf, len))
+					latency_response(LATENCY_AUDIO);
 				player_lock(player);
 			}
 			active = player_active_streams(player->stream);
 			player_unlock(player);
 			if (!active) {
-				i2s_write(PLAYER_I2S_NUM,
-					  i2s_ramp_down_buff, sizeof(i2s_ramp_down_buff),
-					  &bytes_written, portMAX_DELAY);
-
-				memset(i2s_write_buff, 0, PLAYER_PERIOD_SIZE * PLAYER_I2S_SAMPLE_BITS / 8);
-				i2s_write(PLAYER_I2S_NUM,
-					  i2s_write_buff, PLAYER_PERIOD_SIZE * PLAYER_I2S_SAMPLE_BITS / 8,
-					  &bytes_written, portMAX_DELAY);
+				player_write_ramp(buf, i2s_ramp_down_buff,
+						  sizeof(i2s_ramp_down_buff));
+
+				/* Play the ramp out of the whole ring */
+				memset(buf, 0, PLAYER_MIX_SIZE);
+				for (i = 0; i < PLAYER_I2S_DMA_BUFS; ++i)
+					i2s_write_expand(PLAYER_I2S_NUM, buf,
+							 PLAYER_MIX_SIZE, 8,
+							 PLAYER_I2S_SAMPLE_BITS,
+							 &bytes_written,
+							 portMAX_DELAY);
+				/* Let the I2S driver release its no light sleep lock */
+				i2s_stop(PLAYER_I2S_NUM);
 				player->state = STATE_SILENT;
 			}
 			break;
 		}
 	}
-	free(i2s_write_buff);
+	free(buf);
 	vTaskDelete(NULL);
 }
 
-void player_init(void)
+static void player_free(struct player_stream_struct *stream)
 {
-	player_i2s_init();
-	player.lock = xSemaphoreCreateMutex();
-	xTaskCreate(player_task, "player_task", 1024 * 2, &player, 5, NULL);
+	if (stream) {
+		__atomic_fetch_sub(&player.heap, sizeof(*stream), __ATOMIC_RELAXED);
+		free(stream);
+	}
 }
 
-void *player_play(const char *name)
+static void player_fclose(FILE *file)
+{
+	fclose(file);
+	__atomic_fetch_sub(&player.files, 1, __ATOMIC_RELAXED);
+}
+
+static struct player_stream_struct *player_open(int clip)
 {
 	FILE *file;
 	struct player_stream_struct *stream;
 
-	file = fopen(name, "r");
+	file = fopen(cue_clip[clip].path, "r");
 	if (!file)
 		return NULL;
+	__atomic_fetch_add(&player.files, 1, __ATOMIC_RELAXED);
 
 	stream = malloc(sizeof(*stream));
 	if (!stream) {
-		fclose(file);
+		player_fclose(file);
 		return NULL;
 	}
+	__atomic_fetch_add(&player.heap, sizeof(*stream), __ATOMIC_RELAXED);
 
+	stream->clip = clip;
 	stream->offset = 0;
 	fseek(file, 0, SEEK_END);
 	stream->size = ftell(file);
 	fseek(file, 0, SEEK_SET);
 	stream->file = file;
+	stream->primed = false;
+	stream->stage_us = 0;
+	return stream;
+}
+
+/* Where the next chunk of a stream is read from its file */
+static int player_next_read(const struct player_stream_struct *stream)
+{
+	if (stream->primed)
+		return stream->offset + PLAYER_CHUNK_SIZE;
+	return (stream->offset + PLAYER_CHUNK_SIZE - 1) /
+		PLAYER_CHUNK_SIZE * PLAYER_CHUNK_SIZE;
+}
+
+/* A staged stream that is playing and needs its file, player locked */
+static struct player_stream_struct *player_unopened(void)
+{
+	struct player_stream_struct *stream;
+
+	for (stream = player.stream; stream; stream = stream->next)
+		if (!stream->file && player_next_read(stream) < stream->size)
+			return stream;
+	return NULL;
+}
+
+/*
+ * Reopen the files of staged streams that started playing, before the
+ * player task gets to their second chunk. The stream may be closed, or
+ * play past the chunk sought to, while the file is opened, so it is
+ * only handed over if neither happened. Returns false if an open
+ * failed.
+ */
+static bool player_reopen(struct player_struct *player)
+{
+	for (;;) {
+		struct player_stream_struct *stream, *s;
+		FILE *file;
+		int clip, at;
+
+		player_lock(player);
+		stream = player_unopened();
+		if (stream) {
+			clip = stream->clip;
+			at = player_next_read(stream);
+		}
+		player_unlock(player);
+		if (!stream)
+			return true;
+
+		file = fopen(cue_clip[clip].path, "r");
+		if (!file)
+			return false;
+		__atomic_fetch_add(&player->files, 1, __ATOMIC_RELAXED);
+		fseek(file, at, SEEK_SET);
+
+		player_lock(player);
+		for (s = player->stream; s && s != stream; s = s->next)
+			;
+		if (s && !s->file && s->clip == clip &&
+		    player_next_read(s) == at) {
+			s->file = file;
+			file = NULL;
+		}
+		player_unlock(player);
+		if (file)
+			player_fclose(file);
+	}
+}
+
+/* Open a stream and read its first chunk ahead of time */
+static struct player_stream_struct *player_stage(int clip)
+{
+	int64_t start = esp_timer_get_time();
+	struct player_stream_struct *stream = player_open(clip);
+
+	if (!stream)
+		return NULL;
+
+	fread(stream->buf, 1, sizeof(stream->buf), stream->file);
+	player_fclose(stream->file);
+	stream->file = NULL;
+	stream->primed = true;
+	stream->stage_us = esp_timer_get_time() - start;
+	return stream;
+}
+
+static void prefetch_task(void *arg)
+{
+	struct player_struct *player = arg;
+	struct player_prefetch_struct *prefetch = &player->prefetch;
+	TickType_t wait = portMAX_DELAY;
+
+	for (;;) {
+		bool failed = false;
+		int i;
+
+		ulTaskNotifyTake(pdTRUE, wait);
+		wait = portMAX_DELAY;
+		for (i = 0; i < PLAYER_PREFETCH_SLOTS; ++i) {
+			struct player_stream_struct *stream = NULL;
+			int clip;
+
+			/* Streams that started playing go first */
+			if (wait == portMAX_DELAY && !player_reopen(player))
+				wait = pdMS_TO_TICKS(PLAYER_REOPEN_RETRY_MS);
+
+			player_lock(player);
+			clip = prefetch->stream[i] ? PLAYER_NO_CLIP : prefetch->clip[i];
+			player_unlock(player);
+			if (clip != PLAYER_NO_CLIP) {
+				stream = player_stage(clip);
+				failed |= !stream;
+			}
+			if (!stream)
+				continue;
+
+			/* The prediction may have changed while staging */
+			player_lock(player);
+			if (prefetch->clip[i] == clip && !prefetch->stream[i]) {
+				prefetch->stream[i] = stream;
+				stream = NULL;
+			}
+			player_unlock(player);
+			player_free(stream);
+		}
+		if (failed && wait == portMAX_DELAY)
+			wait = pdMS_TO_TICKS(PLAYER_PREFETCH_RETRY_MS);
+	}
+}
+
+/* Take a staged stream for clip, called with the player locked */
+static struct player_stream_struct *player_prefetched(int clip)
+{
+	struct player_prefetch_struct *prefetch = &player.prefetch;
+	bool predicted = false;
+	int i;
+
+	for (i = 0; i < PLAYER_PREFETCH_SLOTS; ++i) {
+		struct player_stream_struct *stream = prefetch->stream[i];
+
+		if (prefetch->clip[i] != clip)
+			continue;
+		predicted = true;
+		if (stream) {
+			prefetch->stream[i] = NULL;
+			++prefetch->hits;
+			prefetch->saved_us += stream->stage_us;
+			return stream;
+		}
+	}
+	if (predicted)
+		++prefetch->misses;
+	else
+		++prefetch->unpredicted;
+	return NULL;
+}
+
+void player_init(void)
+{
+	int i;
+
+	for (i = 0; i < PLAYER_PREFETCH_SLOTS; ++i)
+		player.prefetch.clip[i] = PLAYER_NO_CLIP;
+	player_i2s_init(&player.i2s_queue);
+	player.lock = xSemaphoreCreateMutex();
+	player.task = task_create(TASK_PLAYER, player_task, &player);
+	player.prefetch.task = task_create(TASK_PREFETCH, prefetch_task, &player);
+}
+
+/*
+ * Stage the first chunk of the clips that may be played next.
+ * group is an array of n cue groups, CUE_NONE entries are skipped and
+ * n = 0 drops all staged clips. Clips that stay predicted are kept
+ * staged.
+ */
+void player_prepare(const uint8_t *group, int n)
+{
+	struct player_prefetch_struct *prefetch = &player.prefetch;
+	struct player_stream_struct *staged[PLAYER_PREFETCH_SLOTS];
+	int i, j, k = 0;
+
+	player_lock(&player);
+	memcpy(staged, prefetch->stream, sizeof(staged));
+	for (i = 0; i < PLAYER_PREFETCH_SLOTS; ++i) {
+		while (n && k == cue_group[*group].n) {
+			++group;
+			--n;
+			k = 0;
+		}
+		prefetch->clip[i] = n ? cue_group[*group].clip[k++] : PLAYER_NO_CLIP;
+		prefetch->stream[i] = NULL;
+		for (j = 0; prefetch->clip[i] != PLAYER_NO_CLIP &&
+			    j < PLAYER_PREFETCH_SLOTS; ++j) {
+			if (staged[j] && staged[j]->clip == prefetch->clip[i]) {
+				prefetch->stream[i] = staged[j];
+				staged[j] = NULL;
+				break;
+			}
+		}
+	}
+	player_unlock(&player);
+	for (j = 0; j < PLAYER_PREFETCH_SLOTS; ++j)
+		player_free(staged[j]);
+	xTaskNotifyGive(prefetch->task);
+}
+
+/* Play a clip by its CLIP_* ID from cue_ids.h */
+void *player_play_id(int clip)
+{
+	struct player_stream_struct *stream;
+
+	player_lock(&player);
+	stream = player_prefetched(clip);
+	player_unlock(&player);
+	if (stream)
+		/* Restage it for the next time */
+		xTaskNotifyGive(player.prefetch.task);
+	else
+		stream = player_open(clip);
+	if (!stream)
+		return NULL;
+
 	player_lock(&player);
 	stream->next = player.stream;
 	player.stream = stream;
 	player_unlock(&player);
+	xTaskNotifyGive(player.task);
+	trace_event(TRACE_STREAM_OPEN, (uintptr_t)stream);
 
 	return stream;
 }
@@ -273,8 +703,48 @@ void player_close_stream(void *p)
 		}
 	}
 	player_unlock(&player);
-	fclose(stream->file);
-	free(stream);
+	trace_event(TRACE_STREAM_CLOSE, (uintptr_t)stream);
+	if (stream->file)
+		player_fclose(stream->file);
+	player_free(stream);
+}
+
+/*
+ * Heap used by the player besides its task stack, the I2S driver and
+ * the staged clips, which come and go with failed opens
+ */
+size_t player_heap(void)
+{
+	size_t heap;
+	int i;
+
+	player_lock(&player);
+	heap = player.heap + PLAYER_MIX_SIZE;
+	for (i = 0; i < PLAYER_PREFETCH_SLOTS; ++i)
+		if (player.prefetch.stream[i])
+			heap -= sizeof(*player.prefetch.stream[i]);
+	player_unlock(&player);
+	return heap;
+}
+
+/* Streams being played and files open for streams */
+void player_count(unsigned *streams, unsigned *files)
+{
+	struct player_stream_struct *stream;
+	unsigned n = 0;
+
+	player_lock(&player);
+	for (stream = player.stream; stream; stream = stream->next)
+		++n;
+	player_unlock(&player);
+	*streams = n;
+	*files = player.files;
+}
+
+/* Whether streams are being read from flash */
+bool player_streaming(void)
+{
+	return player.state == STATE_PLAYING;
 }
 
 bool player_is_playing(void *p)
@@ -282,3 +752,26 @@ bool player_is_playing(void *p)
 	struct player_stream_struct *stream = p;
 	return stream->offset < stream->size;
 }
+
+unsigned player_underruns(void)
+{
+	return player.underruns;
+}
+
+void player_stat(void)
+{
+	struct player_prefetch_struct *prefetch = &player.prefetch;
+	unsigned plays = prefetch->hits + prefetch->misses + prefetch->unpredicted;
+
+	printf("audio underruns: %u\n", player.underruns);
+	if (player.periods)
+		printf("mix ahead: %u periods, min %" PRId32 " us, avg %" PRId64 " us, %u late\n",
+		       player.periods, player.margin_min_us,
+		       player.margin_sum_us / player.periods, player.late);
+	printf("prefetch: %u plays, %u hits, %u not staged in time, %u not predicted\n",
+	       plays, prefetch->hits, prefetch->misses, prefetch->unpredicted);
+	if (prefetch->hits)
+		printf("prefetch: %" PRId64 " ms saved, %" PRId64 " us per hit\n",
+		       prefetch->saved_us / 1000,
+		       prefetch->saved_us / prefetch->hits);
+}
@@ -1,9 +1,19 @@
 #ifndef _PLAYER_H
 #define _PLAYER_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
 void player_init(void);
-void *player_play(const char *name);
+void player_prepare(const uint8_t *group, int n);
+void *player_play_id(int clip);
 void player_close_stream(void *stream);
 bool player_is_playing(void *stream);
+bool player_streaming(void);
+size_t player_heap(void);
+void player_count(unsigned *streams, unsigned *files);
+unsigned player_underruns(void);
+void player_stat(void);
 
 #endif
@@ -0,0 +1,183 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_pm.h"
+#include "esp_sleep.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "accel.h"
+#include "power.h"
+
+#ifdef CONFIG_TURRET_IDLE_POWER
+
+/* Typical ESP32 core currents from the datasheet, CPU only, in uA */
+#define POWER_ACTIVE_UA		44000	/* 160 MHz, dual core */
+#define POWER_IDLE_AWAKE_UA	20000	/* 40 MHz */
+#define POWER_LIGHT_SLEEP_UA	800
+
+struct power_struct
+{
+	gpio_num_t wake_gpio;
+	TaskHandle_t task;
+	esp_pm_lock_handle_t cpu_lock;
+	esp_pm_lock_handle_t sleep_lock;
+	bool idle;
+	bool awake;
+	int64_t since;
+	int64_t active_us;
+	int64_t idle_us;
+	int64_t blocked_us;
+	unsigned idle_count;
+	volatile int64_t wake_time;
+	int64_t wake_audio_us;
+	int64_t wake_audio_max_us;
+};
+
+static struct power_struct power;
+
+static void IRAM_ATTR power_wake_isr(void *arg)
+{
+	BaseType_t woken = pdFALSE;
+
+	gpio_intr_disable(power.wake_gpio);
+	power.wake_time = esp_timer_get_time();
+	vTaskNotifyGiveFromISR(power.task, &woken);
+	if (woken)
+		portYIELD_FROM_ISR();
+}
+
+/* Called from the control task, which is woken by the GPIO going high */
+void power_init(gpio_num_t wake_gpio)
+{
+	esp_pm_config_esp32_t pm_config = {
+		.max_freq_mhz = CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ,
+		.min_freq_mhz = CONFIG_TURRET_IDLE_CPU_FREQ_MHZ,
+		.light_sleep_enable = true,
+	};
+
+	power.wake_gpio = wake_gpio;
+	power.task = xTaskGetCurrentTaskHandle();
+	power.since = esp_timer_get_time();
+
+	ESP_ERROR_CHECK(esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "active",
+					   &power.cpu_lock));
+	ESP_ERROR_CHECK(esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, "awake",
+					   &power.sleep_lock));
+	esp_pm_lock_acquire(power.cpu_lock);
+	esp_pm_lock_acquire(power.sleep_lock);
+	power.awake = true;
+	ESP_ERROR_CHECK(esp_pm_configure(&pm_config));
+
+	gpio_wakeup_enable(wake_gpio, GPIO_INTR_HIGH_LEVEL);
+	esp_sleep_enable_gpio_wakeup();
+	gpio_install_isr_service(0);
+	gpio_isr_handler_add(wake_gpio, power_wake_isr, NULL);
+	gpio_intr_disable(wake_gpio);
+}
+
+/* Full speed and no light sleep, the wake GPIO interrupt is off meanwhile */
+static void power_awake(bool awake)
+{
+	if (awake == power.awake)
+		return;
+	power.awake = awake;
+	if (awake) {
+		esp_pm_lock_acquire(power.cpu_lock);
+		esp_pm_lock_acquire(power.sleep_lock);
+		gpio_intr_disable(power.wake_gpio);
+	} else {
+		gpio_intr_enable(power.wake_gpio);
+		esp_pm_lock_release(power.sleep_lock);
+		esp_pm_lock_release(power.cpu_lock);
+	}
+}
+
+/*
+ * Switch between full speed and idle mode, where the CPU runs at the
+ * minimum frequency and light sleeps between wakeups. Returns whether
+ * idle mode is in effect.
+ */
+bool power_idle(bool idle)
+{
+	int64_t now;
+
+	if (idle == power.idle)
+		return idle;
+
+	now = esp_timer_get_time();
+	if (idle) {
+		power.active_us += now - power.since;
+		++power.idle_count;
+		power.wake_time = 0;
+		accel_fifo(true);
+		power_awake(false);
+	} else {
+		power_awake(true);
+		accel_fifo(false);
+		power.idle_us += now - power.since;
+	}
+	power.since = now;
+	power.idle = idle;
+	return idle;
+}
+
+/*
+ * Block until the wake GPIO fires or the accelerometer FIFO is due to
+ * be drained. Returns the number of control loop ticks to catch up.
+ * When woken by the PIR the CPU is back at full speed on return, ahead
+ * of the first cue. The FIFO stays in stream mode until the control
+ * loop leaves idle mode after those ticks, bypass mode would empty it.
+ */
+int power_sleep(void)
+{
+	int64_t t = esp_timer_get_time();
+	int n;
+
+	ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(CONFIG_TURRET_IDLE_POLL_MS));
+	power.blocked_us += esp_timer_get_time() - t;
+	n = accel_fifo_entries();
+	power_awake(gpio_get_level(power.wake_gpio));
+	return n ? n : 1;
+}
+
+/* Called by the player when it leaves silence */
+void power_audio_started(void)
+{
+	int64_t wake = power.wake_time;
+
+	if (!wake)
+		return;
+	power.wake_time = 0;
+	power.wake_audio_us = esp_timer_get_time() - wake;
+	if (power.wake_audio_us > power.wake_audio_max_us)
+		power.wake_audio_max_us = power.wake_audio_us;
+}
+
+void power_stat(void)
+{
+	int64_t now = esp_timer_get_time();
+	int64_t active = power.active_us + (power.idle ? 0 : now - power.since);
+	int64_t idle = power.idle_us + (power.idle ? now - power.since : 0);
+	int64_t awake = idle - power.blocked_us;
+	int64_t total = active + idle;
+	int64_t ua;
+
+	if (awake < 0)
+		awake = 0;
+	ua = total ? (active * POWER_ACTIVE_UA + awake * POWER_IDLE_AWAKE_UA +
+		      power.blocked_us * POWER_LIGHT_SLEEP_UA) / total : 0;
+
+	printf("%s, entered idle %u times\n", power.idle ? "idle" : "active",
+	       power.idle_count);
+	printf("active %" PRId64 " s, idle %" PRId64 " s (%" PRId64 " s asleep)\n",
+	       active / 1000000, idle / 1000000, power.blocked_us / 1000000);
+	printf("wake to first audio: last %" PRId64 " ms, max %" PRId64 " ms\n",
+	       power.wake_audio_us / 1000, power.wake_audio_max_us / 1000);
+	printf("estimated average CPU current %" PRId64 ".%01" PRId64 " mA\n",
+	       ua / 1000, ua % 1000 / 100);
+}
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef POWER_H
+#define POWER_H
+
+#include <stdbool.h>
+#include "driver/gpio.h"
+#include "sdkconfig.h"
+
+#ifdef CONFIG_TURRET_IDLE_POWER
+void power_init(gpio_num_t wake_gpio);
+bool power_idle(bool idle);
+int power_sleep(void);
+void power_audio_started(void);
+void power_stat(void);
+#else
+static inline void power_init(gpio_num_t wake_gpio) {}
+static inline bool power_idle(bool idle) { return false; }
+static inline int power_sleep(void) { return 1; }
+static inline void power_audio_started(void) {}
+#endif
+
+#endif
@@ -0,0 +1,514 @@
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_random.h"
+#include "esp_system.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+
+#include "accel.h"
+#include "record.h"
+#include "tasks.h"
+#include "wings.h"
+
+#ifdef CONFIG_TURRET_RECORD
+
+/*
+ * Per-tick sensor inputs are stored in the "record" partition used as a
+ * ring of flash sectors. Each sector starts with struct record_header,
+ * followed by one record per tick:
+ *
+ *   byte 0: bit 0 -- PIR level, bit 1 -- end switch level,
+ *           bits 2..3 -- accelerometer encoding, bits 4..7 -- repeat
+ *   RECORD_SAME:   accelerometer unchanged, the same inputs repeat for
+ *                  `repeat` more ticks
+ *   RECORD_NIBBLE: x, y, z deltas, 4 bits each, 2 bytes
+ *   RECORD_BYTE:   x, y, z deltas, 8 bits each, 3 bytes
+ *   RECORD_RAW:    x, y, z as little endian int16, 6 bytes
+ *
+ * RECORD_END (erased flash) terminates the sector. The first record of
+ * every sector is RECORD_RAW, and the RNG is reseeded from the sector
+ * header. The header also holds the accelerometer calibration and the
+ * wing model at the start of the sector. A replay may start at any
+ * sector and takes both from there, not from the unit's NVS. See
+ * tools/recdec.py.
+ */
+#define RECORD_PARTITION_SUBTYPE	0x40
+#define RECORD_MAGIC		0x32455254	/* "TRE2" */
+#define RECORD_SECTOR_SIZE	SPI_FLASH_SEC_SIZE
+#define RECORD_CHUNK_SIZE	256
+#define RECORD_MAX		(1 + 6)
+#define RECORD_END		0xff
+
+#define RECORD_PIR_BIT		0x1
+#define RECORD_END_SWITCH_BIT	0x2
+#define RECORD_LEVELS		(RECORD_PIR_BIT | RECORD_END_SWITCH_BIT)
+#define RECORD_ACCEL_BIT	0x4
+#define RECORD_ALL		(RECORD_LEVELS | RECORD_ACCEL_BIT)
+
+#define RECORD_MODE_SHIFT	2
+#define RECORD_MODE_MASK	0x3
+#define RECORD_REPEAT_SHIFT	4
+#define RECORD_REPEAT_MAX	15
+
+#define RECORD_FLAG_SESSION	0x1
+
+enum {
+	RECORD_SAME,
+	RECORD_NIBBLE,
+	RECORD_BYTE,
+	RECORD_RAW,
+};
+
+struct record_header {
+	uint32_t magic;
+	uint32_t seq;
+	uint32_t seed;
+	uint32_t flags;
+	struct accel_cal accel;
+	struct wings_model wings;
+};
+
+struct record_input {
+	uint8_t levels;
+	int16_t accel[3];
+};
+
+struct record_chunk {
+	int idx;
+	uint32_t offset;
+};
+
+struct record_struct
+{
+	enum {
+		STATE_OFF,
+		STATE_RECORDING,
+		STATE_REPLAYING,
+	} state;
+	const esp_partition_t *partition;
+	int n_sectors;
+	int sector;
+	uint32_t seq;
+	uint32_t end_seq;
+	int pos;
+	int chunk_start;
+	uint8_t latched;
+	struct record_input cur;
+	struct record_input prev;
+	bool prev_valid;
+	uint8_t pending;
+	bool pending_valid;
+	int repeat;
+	uint8_t chunk[2][RECORD_CHUNK_SIZE];
+	int chunk_idx;
+	volatile bool chunk_busy[2];
+	QueueHandle_t queue;
+	unsigned ticks;
+};
+
+static struct record_struct record;
+
+/* Session to replay, survives the restart issued by record_replay() */
+static RTC_NOINIT_ATTR uint32_t record_replay_magic;
+static RTC_NOINIT_ATTR int record_replay_session;
+
+static bool record_read_header(int sector, struct record_header *h)
+{
+	return esp_partition_read(record.partition, sector * RECORD_SECTOR_SIZE,
+				  h, sizeof(*h)) == ESP_OK &&
+		h->magic == RECORD_MAGIC;
+}
+
+static void record_task(void *arg)
+{
+	struct record_chunk c;
+
+	for (;;) {
+		xQueueReceive(record.queue, &c, portMAX_DELAY);
+		if (c.offset % RECORD_SECTOR_SIZE == 0)
+			esp_partition_erase_range(record.partition, c.offset,
+						  RECORD_SECTOR_SIZE);
+		esp_partition_write(record.partition, c.offset,
+				    record.chunk[c.idx], RECORD_CHUNK_SIZE);
+		record.chunk_busy[c.idx] = false;
+	}
+}
+
+static void record_flush_chunk(void)
+{
+	struct record_chunk c = {
+		.idx = record.chunk_idx,
+		.offset = record.sector * RECORD_SECTOR_SIZE + record.chunk_start,
+	};
+	int used = record.pos - record.chunk_start;
+
+	memset(record.chunk[c.idx] + used, RECORD_END, RECORD_CHUNK_SIZE - used);
+	record.chunk_busy[c.idx] = true;
+	xQueueSend(record.queue, &c, portMAX_DELAY);
+
+	record.chunk_idx ^= 1;
+	record.chunk_start = record.pos;
+	if (record.chunk_busy[record.chunk_idx]) {
+		ESP_LOGE(__func__, "flash writes fell behind, recording stopped");
+		record.state = STATE_OFF;
+	}
+}
+
+static void record_put(uint8_t b)
+{
+	if (record.state != STATE_RECORDING)
+		return;
+	record.chunk[record.chunk_idx][record.pos - record.chunk_start] = b;
+	if (++record.pos - record.chunk_start == RECORD_CHUNK_SIZE)
+		record_flush_chunk();
+}
+
+static void record_flush_pending(void)
+{
+	if (record.pending_valid) {
+		record.pending_valid = false;
+		record_put(record.pending);
+	}
+}
+
+static void record_new_sector(uint32_t flags)
+{
+	struct record_header h = {
+		.magic = RECORD_MAGIC,
+		.seq = record.seq + 1,
+		.seed = esp_random(),
+		.flags = flags,
+	};
+	const uint8_t *p = (const uint8_t *)&h;
+	size_t i;
+
+	/* Recording needs CONFIG_TURRET_HEADS = 1 */
+	accel_cal_get(accel_head(0), &h.accel);
+	wings_model_get(wings_head(0), &h.wings);
+
+	record_flush_pending();
+	if (record.pos != record.chunk_start)
+		record_flush_chunk();
+
+	record.sector = (record.sector + 1) % record.n_sectors;
+	record.seq = h.seq;
+	record.pos = 0;
+	record.chunk_start = 0;
+	for (i = 0; i < sizeof(h); ++i)
+		record_put(p[i]);
+	record.prev_valid = false;
+	srand(h.seed);
+}
+
+static void record_encode(void)
+{
+	const struct record_input *c = &record.cur;
+	uint8_t b = c->levels;
+	int d[3];
+	int max = 0;
+	int mode;
+	int i;
+
+	for (i = 0; i < 3; ++i) {
+		d[i] = c->accel[i] - record.prev.accel[i];
+		if (abs(d[i]) > max)
+			max = abs(d[i]);
+	}
+
+	if (!record.prev_valid)
+		mode = RECORD_RAW;
+	else if (max == 0)
+		mode = RECORD_SAME;
+	else if (max < 8)
+		mode = RECORD_NIBBLE;
+	else if (max < 128)
+		mode = RECORD_BYTE;
+	else
+		mode = RECORD_RAW;
+
+	record.prev = *c;
+	record.prev_valid = true;
+
+	if (mode == RECORD_SAME) {
+		if (record.pending_valid &&
+		    (record.pending & RECORD_LEVELS) == b &&
+		    (record.pending >> RECORD_REPEAT_SHIFT) < RECORD_REPEAT_MAX) {
+			record.pending += 1 << RECORD_REPEAT_SHIFT;
+		} else {
+			record_flush_pending();
+			record.pending = b;
+			record.pending_valid = true;
+		}
+		return;
+	}
+
+	record_flush_pending();
+	record_put(b | mode << RECORD_MODE_SHIFT);
+	switch (mode) {
+	case RECORD_NIBBLE:
+		record_put((d[0] & 0xf) | (d[1] & 0xf) << 4);
+		record_put(d[2] & 0xf);
+		break;
+	case RECORD_BYTE:
+		for (i = 0; i < 3; ++i)
+			record_put(d[i]);
+		break;
+	case RECORD_RAW:
+		for (i = 0; i < 3; ++i) {
+			record_put(c->accel[i]);
+			record_put(c->accel[i] >> 8);
+		}
+		break;
+	}
+}
+
+static void record_stop_replay(void)
+{
+	ESP_LOGI(__func__, "replay done after %u ticks", record.ticks);
+	record.state = STATE_OFF;
+}
+
+static bool record_replay_sector(int sector)
+{
+	struct record_header h;
+
+	if (!record_read_header(sector, &h) || h.seq != record.seq + 1 ||
+	    h.seq >= record.end_seq)
+		return false;
+	record.sector = sector;
+	record.seq = h.seq;
+	record.pos = sizeof(h);
+	record.chunk_start = -1;
+	srand(h.seed);
+	return true;
+}
+
+static int record_get(void)
+{
+	if (record.pos >= RECORD_SECTOR_SIZE)
+		return RECORD_END;
+	if (record.chunk_start < 0 ||
+	    record.pos - record.chunk_start >= RECORD_CHUNK_SIZE) {
+		record.chunk_start = record.pos / RECORD_CHUNK_SIZE * RECORD_CHUNK_SIZE;
+		esp_partition_read(record.partition,
+				   record.sector * RECORD_SECTOR_SIZE + record.chunk_start,
+				   record.chunk[0], RECORD_CHUNK_SIZE);
+	}
+	return record.chunk[0][record.pos++ - record.chunk_start];
+}
+
+static void record_decode(void)
+{
+	struct record_input *c = &record.cur;
+	int b;
+	int i;
+
+	if (record.repeat) {
+		--record.repeat;
+		return;
+	}
+
+	while ((b = record_get()) == RECORD_END) {
+		if (!record_replay_sector((record.sector + 1) % record.n_sectors)) {
+			record_stop_replay();
+			return;
+		}
+	}
+
+	c->levels = b & RECORD_LEVELS;
+	switch ((b >> RECORD_MODE_SHIFT) & RECORD_MODE_MASK) {
+	case RECORD_SAME:
+		record.repeat = b >> RECORD_REPEAT_SHIFT;
+		break;
+	case RECORD_NIBBLE:
+		b = record_get();
+		c->accel[0] += (int8_t)(b << 4) >> 4;
+		c->accel[1] += (int8_t)b >> 4;
+		c->accel[2] += (int8_t)(record_get() << 4) >> 4;
+		break;
+	case RECORD_BYTE:
+		for (i = 0; i < 3; ++i)
+			c->accel[i] += (int8_t)record_get();
+		break;
+	case RECORD_RAW:
+		for (i = 0; i < 3; ++i) {
+			b = record_get();
+			c->accel[i] = b | record_get() << 8;
+		}
+		break;
+	}
+}
+
+/* Find the start of the session'th newest session and replay it */
+static void record_start_replay(int session)
+{
+	struct record_header h;
+	uint32_t end_seq = record.seq + 1;
+	uint32_t start_seq = 0;
+	int sector = record.sector;
+	int start = -1;
+	int i;
+
+	for (i = 0; i < record.n_sectors; ++i) {
+		if (!record_read_header(sector, &h) || h.seq != record.seq - i)
+			break;
+		start = sector;
+		start_seq = h.seq;
+		if (h.flags & RECORD_FLAG_SESSION) {
+			if (--session == 0)
+				break;
+			end_seq = h.seq;
+			start = -1;
+		}
+		sector = (sector + record.n_sectors - 1) % record.n_sectors;
+	}
+
+	if (start < 0 || session > 1) {
+		ESP_LOGE(__func__, "no such session");
+		return;
+	}
+	if (session)
+		ESP_LOGW(__func__, "session start overwritten, replaying from a cold state");
+
+	record.end_seq = end_seq;
+	record.seq = start_seq - 1;
+	record_replay_sector(start);
+	record_read_header(start, &h);
+	accel_cal_set(accel_head(0), &h.accel);
+	wings_model_set(wings_head(0), &h.wings);
+	record.latched = RECORD_ALL;
+	record.state = STATE_REPLAYING;
+	ESP_LOGI(__func__, "replaying %" PRIu32 " sectors", end_seq - record.seq);
+}
+
+void record_init(void)
+{
+	struct record_header h;
+	int i;
+
+	record.partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+						    RECORD_PARTITION_SUBTYPE,
+						    "record");
+	if (!record.partition) {
+		ESP_LOGE(__func__, "no record partition");
+		return;
+	}
+	record.n_sectors = record.partition->size / RECORD_SECTOR_SIZE;
+	record.sector = record.n_sectors - 1;
+	for (i = 0; i < record.n_sectors; ++i) {
+		if (record_read_header(i, &h) && h.seq >= record.seq) {
+			record.seq = h.seq;
+			record.sector = i;
+		}
+	}
+
+	if (record_replay_magic == RECORD_MAGIC) {
+		record_replay_magic = 0;
+		record_start_replay(record_replay_session);
+		return;
+	}
+
+	record.pos = RECORD_SECTOR_SIZE;
+	record.chunk_start = RECORD_SECTOR_SIZE;
+	record.queue = xQueueCreate(2, sizeof(struct record_chunk));
+	task_create(TASK_RECORD, record_task, NULL);
+	record.state = STATE_RECORDING;
+}
+
+/* Called at the start of every control loop iteration */
+void record_tick(void)
+{
+	switch (record.state) {
+	case STATE_OFF:
+		return;
+
+	case STATE_RECORDING:
+		if (record.ticks)
+			record_encode();
+		if (record.pos + RECORD_MAX + record.pending_valid > RECORD_SECTOR_SIZE)
+			record_new_sector(record.ticks ? 0 : RECORD_FLAG_SESSION);
+		record.latched = 0;
+		break;
+
+	case STATE_REPLAYING:
+		record_decode();
+		break;
+	}
+	++record.ticks;
+}
+
+/*
+ * Inputs are latched on first use in a tick, so that every reader in
+ * the tick sees the value that gets recorded.
+ */
+static bool record_level(uint8_t bit, bool level)
+{
+	if (record.state == STATE_OFF)
+		return level;
+	if (!(record.latched & bit)) {
+		record.latched |= bit;
+		if (level)
+			record.cur.levels |= bit;
+		else
+			record.cur.levels &= ~bit;
+	}
+	return record.cur.levels & bit;
+}
+
+bool record_pir(bool level)
+{
+	return record_level(RECORD_PIR_BIT, level);
+}
+
+bool record_end_switch(bool level)
+{
+	return record_level(RECORD_END_SWITCH_BIT, level);
+}
+
+void record_accel(int16_t *x, int16_t *y, int16_t *z)
+{
+	if (record.state == STATE_OFF)
+		return;
+	if (!(record.latched & RECORD_ACCEL_BIT)) {
+		record.latched |= RECORD_ACCEL_BIT;
+		record.cur.accel[0] = *x;
+		record.cur.accel[1] = *y;
+		record.cur.accel[2] = *z;
+	}
+	*x = record.cur.accel[0];
+	*y = record.cur.accel[1];
+	*z = record.cur.accel[2];
+}
+
+bool record_replaying(void)
+{
+	return record.state == STATE_REPLAYING;
+}
+
+/* Restart and feed the session'th newest recording through the control loop */
+void record_replay(int session)
+{
+	record_replay_session = session;
+	record_replay_magic = RECORD_MAGIC;
+	esp_restart();
+}
+
+void record_stat(void)
+{
+	static const char * const state_name[] = {
+		[STATE_OFF] = "off",
+		[STATE_RECORDING] = "recording",
+		[STATE_REPLAYING] = "replaying",
+	};
+
+	printf("%s, %u ticks, sector %d of %d, seq %" PRIu32 ", offset %d\n",
+	       state_name[record.state], record.ticks,
+	       record.sector, record.n_sectors, record.seq, record.pos);
+}
+
+#endif
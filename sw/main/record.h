@@ -0,0 +1,26 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "sdkconfig.h"
+
+#ifdef CONFIG_TURRET_RECORD
+void record_init(void);
+void record_tick(void);
+bool record_pir(bool level);
+bool record_end_switch(bool level);
+void record_accel(int16_t *x, int16_t *y, int16_t *z);
+void record_replay(int session);
+bool record_replaying(void);
+void record_stat(void);
+#else
+static inline void record_init(void) {}
+static inline void record_tick(void) {}
+static inline bool record_pir(bool level) { return level; }
+static inline bool record_end_switch(bool level) { return level; }
+static inline void record_accel(int16_t *x, int16_t *y, int16_t *z) {}
+static inline bool record_replaying(void) { return false; }
+#endif
+
+#endif
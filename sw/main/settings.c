@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <string.h>
+#include "esp_err.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "nvs.h"
+#include "nvs_flash.h"
+
+#include "record.h"
+#include "settings.h"
+#include "tasks.h"
+
+#define SETTINGS_NAMESPACE	"turret"
+/* Saves waiting for the flash, a calibration and a wing model per head */
+#define SETTINGS_QUEUE_SIZE	4
+#define SETTINGS_DATA_MAX	32
+
+struct settings_save_struct {
+	char key[SETTINGS_KEY_SIZE];
+	size_t len;
+	uint8_t data[SETTINGS_DATA_MAX];
+};
+
+/* Per-unit values learned at run time, kept in the nvs partition */
+static nvs_handle_t settings;
+static QueueHandle_t settings_queue;
+
+/* Writes and commits the saves, off the control loop */
+static void settings_task(void *arg)
+{
+	struct settings_save_struct s;
+
+	for (;;) {
+		esp_err_t err;
+
+		xQueueReceive(settings_queue, &s, portMAX_DELAY);
+		err = nvs_set_blob(settings, s.key, s.data, s.len);
+		if (err == ESP_OK)
+			err = nvs_commit(settings);
+		if (err != ESP_OK)
+			ESP_LOGE(__func__, "%s: %s", s.key, esp_err_to_name(err));
+	}
+}
+
+void settings_init(void)
+{
+	esp_err_t err = nvs_flash_init();
+
+	if (err == ESP_ERR_NVS_NO_FREE_PAGES ||
+	    err == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+		ESP_ERROR_CHECK(nvs_flash_erase());
+		err = nvs_flash_init();
+	}
+	if (err == ESP_OK)
+		err = nvs_open(SETTINGS_NAMESPACE, NVS_READWRITE, &settings);
+	if (err != ESP_OK) {
+		ESP_LOGE(__func__, "%s", esp_err_to_name(err));
+		return;
+	}
+	settings_queue = xQueueCreate(SETTINGS_QUEUE_SIZE,
+				      sizeof(struct settings_save_struct));
+	task_create(TASK_SETTINGS, settings_task, NULL);
+}
+
+/* Returns false unless exactly len bytes are stored under key */
+bool settings_load(const char *key, void *data, size_t len)
+{
+	size_t size = len;
+
+	return settings &&
+		nvs_get_blob(settings, key, data, &size) == ESP_OK &&
+		size == len;
+}
+
+/*
+ * Queues the value for settings_task and returns, the flash write and
+ * commit do not hold up the caller. Replays learn from a recording of
+ * maybe another unit, that is not kept.
+ */
+void settings_save(const char *key, const void *data, size_t len)
+{
+	struct settings_save_struct s = { .len = len };
+
+	if (record_replaying())
+		return;
+	if (!settings_queue || len > sizeof(s.data)) {
+		ESP_LOGE(__func__, "%s: %s", key,
+			 esp_err_to_name(ESP_ERR_INVALID_STATE));
+		return;
+	}
+	snprintf(s.key, sizeof(s.key), "%s", key);
+	memcpy(s.data, data, len);
+	if (xQueueSend(settings_queue, &s, 0) != pdTRUE)
+		ESP_LOGE(__func__, "%s: queue full, not saved", key);
+}
+
+/* Key of a per-head value in buf, the first head keeps the plain key */
+void settings_head_key(char *buf, const char *key, int head)
+{
+	if (head)
+		snprintf(buf, SETTINGS_KEY_SIZE, "%s%d", key, head);
+	else
+		snprintf(buf, SETTINGS_KEY_SIZE, "%s", key);
+}
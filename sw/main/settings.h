@@ -0,0 +1,15 @@
+#ifndef SETTINGS_H
+#define SETTINGS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* NVS key names are at most 15 characters */
+#define SETTINGS_KEY_SIZE	16
+
+void settings_init(void);
+bool settings_load(const char *key, void *data, size_t len);
+void settings_save(const char *key, const void *data, size_t len);
+void settings_head_key(char *buf, const char *key, int head);
+
+#endif
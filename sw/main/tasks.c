@@ -0,0 +1,162 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "esp_log.h"
+
+#include "tasks.h"
+
+struct task_config {
+	const char *name;
+	int core;
+	UBaseType_t priority;
+	uint32_t stack;
+};
+
+/*
+ * Audio and control run on separate cores, so mixing and I2S refills
+ * never wait for the control loop, accelerometer I2C or flash writes.
+ */
+static const struct task_config task_config[TASK_N] = {
+	[TASK_CONTROL] = {
+		.name = "control_task",
+		.core = CONFIG_TURRET_CONTROL_CORE,
+		.priority = 5,
+		.stack = 1024 * 3,
+	},
+	[TASK_PLAYER] = {
+		.name = "player_task",
+		.core = CONFIG_TURRET_AUDIO_CORE,
+		.priority = 10,
+		.stack = 1024 * 2,
+	},
+	[TASK_PREFETCH] = {
+		.name = "prefetch_task",
+		.core = CONFIG_TURRET_CONTROL_CORE,
+		.priority = 3,
+		.stack = 1024 * 2,
+	},
+	[TASK_RECORD] = {
+		.name = "record_task",
+		.core = CONFIG_TURRET_CONTROL_CORE,
+		.priority = 2,
+		.stack = 1024 * 2,
+	},
+	/* NVS writes of learned values, whenever nothing else runs */
+	[TASK_SETTINGS] = {
+		.name = "settings_task",
+		.core = CONFIG_TURRET_CONTROL_CORE,
+		.priority = 1,
+		.stack = 1024 * 3,
+	},
+	[TASK_LATENCY] = {
+		.name = "latency_task",
+		.core = CONFIG_TURRET_CONTROL_CORE,
+		.priority = 1,
+		.stack = 1024 * 3,
+	},
+	/* Mounts FAT while app_main brings up the rest, exits when done */
+	[TASK_BOOT] = {
+		.name = "boot_task",
+		.core = CONFIG_TURRET_AUDIO_CORE,
+		.priority = 5,
+		.stack = 1024 * 4,
+	},
+};
+
+static TaskHandle_t task_handle[TASK_N];
+
+TaskHandle_t task_create(int task, TaskFunction_t fn, void *arg)
+{
+	const struct task_config *c = task_config + task;
+
+	if (xTaskCreatePinnedToCore(fn, c->name, c->stack, arg, c->priority,
+				    task_handle + task, c->core) != pdPASS) {
+		ESP_LOGE(__func__, "failed to create %s", c->name);
+		return NULL;
+	}
+	return task_handle[task];
+}
+
+/* Stack size and high-water, in bytes, for the tasks created from the table */
+void tasks_stack_stat(void)
+{
+	int i;
+
+	printf("%-16s %6s %6s\n", "task", "stack", "free");
+	for (i = 0; i < TASK_N; ++i) {
+		if (!task_handle[i])
+			continue;
+		printf("%-16s %6" PRIu32 " %6u\n", task_config[i].name,
+		       task_config[i].stack,
+		       uxTaskGetStackHighWaterMark(task_handle[i]));
+	}
+}
+
+/* Delete the calling task, which was created from the table */
+void task_exit(int task)
+{
+	task_handle[task] = NULL;
+	vTaskDelete(NULL);
+}
+
+#ifdef CONFIG_TURRET_TASK_STATS
+#define TASKS_MAX	32
+
+/* CPU utilisation since the previous call, stack high-water for all tasks */
+void tasks_stat(void)
+{
+	static TaskHandle_t last_handle[TASKS_MAX];
+	static uint32_t last_time[TASKS_MAX];
+	static uint32_t last_total;
+	UBaseType_t n = uxTaskGetNumberOfTasks();
+	TaskStatus_t *status = malloc(n * sizeof(*status));
+	uint32_t total;
+	uint32_t dt;
+	UBaseType_t i;
+	int j;
+
+	if (!status)
+		return;
+	n = uxTaskGetSystemState(status, n, &total);
+	dt = (total - last_total) ? total - last_total : 1;
+
+	printf("%-16s %4s %4s %6s %6s\n", "task", "core", "prio", "cpu%", "stack");
+	for (i = 0; i < n; ++i) {
+		TaskStatus_t *s = status + i;
+		uint32_t t = s->ulRunTimeCounter;
+		BaseType_t core = xTaskGetAffinity(s->xHandle);
+
+		for (j = 0; j < TASKS_MAX; ++j)
+			if (last_handle[j] == s->xHandle) {
+				t -= last_time[j];
+				break;
+			}
+		printf("%-16s %4s %4u %5" PRIu32 "%% %6u\n", s->pcTaskName,
+		       core == tskNO_AFFINITY ? "any" : core ? "1" : "0",
+		       s->uxCurrentPriority, (uint32_t)(100ULL * t / dt),
+		       s->usStackHighWaterMark);
+	}
+
+	for (i = 0; i < n && i < TASKS_MAX; ++i) {
+		last_handle[i] = status[i].xHandle;
+		last_time[i] = status[i].ulRunTimeCounter;
+	}
+	last_total = total;
+	free(status);
+}
+#else
+/* Stack high-water for the tasks created from the table */
+void tasks_stat(void)
+{
+	int i;
+
+	printf("%-16s %4s %4s %6s\n", "task", "core", "prio", "stack");
+	for (i = 0; i < TASK_N; ++i) {
+		if (!task_handle[i])
+			continue;
+		printf("%-16s %4d %4u %6u\n", task_config[i].name,
+		       task_config[i].core, task_config[i].priority,
+		       uxTaskGetStackHighWaterMark(task_handle[i]));
+	}
+}
+#endif
@@ -0,0 +1,23 @@
+#ifndef TASKS_H
+#define TASKS_H
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+enum {
+	TASK_CONTROL,
+	TASK_PLAYER,
+	TASK_PREFETCH,
+	TASK_RECORD,
+	TASK_SETTINGS,
+	TASK_LATENCY,
+	TASK_BOOT,
+	TASK_N,
+};
+
+TaskHandle_t task_create(int task, TaskFunction_t fn, void *arg);
+void task_exit(int task);
+void tasks_stat(void);
+void tasks_stack_stat(void);
+
+#endif
@@ -0,0 +1,126 @@
+#include <inttypes.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "esp_attr.h"
+#include "hal/cpu_hal.h"
+
+#include "head.h"
+#include "player.h"
+#include "timing.h"
+
+#ifdef CONFIG_TURRET_HOT_PATH_TIMING
+
+/* Control loop period, TICK_MS in app_main.c */
+#define TIMING_TICK_MS		10
+
+/*
+ * Each function is timed by a single task, so the counters need no
+ * locking. Samples taken while the player streams from flash are kept
+ * apart, that is when code fetches miss the flash cache the most.
+ */
+struct timing_stat_struct
+{
+	uint32_t n;
+	uint32_t min;
+	uint32_t max;
+	uint64_t sum;
+	uint64_t sum2;
+};
+
+struct timing_struct
+{
+	struct timing_stat_struct stat[TIMING_N][2];
+};
+
+static struct timing_struct timing;
+
+static const char * const timing_name[TIMING_N] = {
+	[TIMING_PLAYER_MIX] = "player_mix",
+	[TIMING_ACCEL_TICK] = "accel_tick",
+	[TIMING_GUNS_TICK] = "guns_tick",
+	[TIMING_WINGS_TICK] = "wings_tick",
+	[TIMING_MACHINE_TICK] = "machine_tick",
+	[TIMING_HEAD_TICK] = "head_tick",
+};
+
+uint32_t IRAM_ATTR timing_begin(void)
+{
+	return cpu_hal_get_cycle_count();
+}
+
+/* Account the cycles since begin to fn, returns the begin of the next one */
+uint32_t IRAM_ATTR timing_end(int fn, uint32_t begin)
+{
+	uint32_t end = cpu_hal_get_cycle_count();
+	uint32_t dt = end - begin;
+	struct timing_stat_struct *s = &timing.stat[fn][player_streaming()];
+
+	if (!s->n || dt < s->min)
+		s->min = dt;
+	if (dt > s->max)
+		s->max = dt;
+	s->sum += dt;
+	s->sum2 += (uint64_t)dt * dt;
+	++s->n;
+	return cpu_hal_get_cycle_count();
+}
+
+/*
+ * Heads whose ticks fit in the control period back to back, by the mean
+ * and the worst head tick. Shared work per tick is left out, it is a
+ * small fraction of a head.
+ */
+static void timing_heads(void)
+{
+	const struct timing_stat_struct *s = timing.stat[TIMING_HEAD_TICK];
+	uint64_t budget = (uint64_t)CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ * 1000 *
+		TIMING_TICK_MS;
+	uint64_t sum = s[0].sum + s[1].sum;
+	uint32_t n = s[0].n + s[1].n;
+	uint32_t max = s[0].max > s[1].max ? s[0].max : s[1].max;
+
+	if (!n || !max)
+		return;
+	printf("%d heads, %" PRIu64 " cycles per head tick on average: %" PRIu64 " heads fit %d ms, %" PRIu64 " at worst\n",
+	       HEADS, sum / n, budget * n / sum, TIMING_TICK_MS,
+	       budget / max);
+}
+
+void timing_stat(void)
+{
+	int i, j;
+
+	printf("hot paths in %s, cycles:\n",
+#ifdef CONFIG_TURRET_IRAM_HOT_PATHS
+	       "IRAM"
+#else
+	       "flash"
+#endif
+	       );
+	printf("%-12s %-9s %8s %8s %8s %8s %8s\n",
+	       "function", "flash io", "n", "min", "mean", "stddev", "max");
+	for (i = 0; i < TIMING_N; ++i) {
+		for (j = 0; j < 2; ++j) {
+			const struct timing_stat_struct *s = &timing.stat[i][j];
+			double mean, var;
+
+			if (!s->n)
+				continue;
+			mean = (double)s->sum / s->n;
+			var = (double)s->sum2 / s->n - mean * mean;
+			printf("%-12s %-9s %8" PRIu32 " %8" PRIu32 " %8.0f %8.0f %8" PRIu32 "\n",
+			       timing_name[i], j ? "streaming" : "idle",
+			       s->n, s->min, mean, var > 0 ? sqrt(var) : 0, s->max);
+		}
+	}
+	timing_heads();
+}
+
+void timing_reset(void)
+{
+	memset(&timing, 0, sizeof(timing));
+}
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <stdint.h>
+#include "sdkconfig.h"
+
+/*
+ * Hot paths, all but machine_tick placed in IRAM by
+ * CONFIG_TURRET_IRAM_HOT_PATHS. head_tick spans the four per-head ones.
+ */
+enum {
+	TIMING_PLAYER_MIX,
+	TIMING_ACCEL_TICK,
+	TIMING_GUNS_TICK,
+	TIMING_WINGS_TICK,
+	TIMING_MACHINE_TICK,
+	TIMING_HEAD_TICK,
+	TIMING_N,
+};
+
+#ifdef CONFIG_TURRET_HOT_PATH_TIMING
+uint32_t timing_begin(void);
+uint32_t timing_end(int fn, uint32_t begin);
+void timing_stat(void);
+void timing_reset(void);
+#else
+static inline uint32_t timing_begin(void) { return 0; }
+static inline uint32_t timing_end(int fn, uint32_t begin) { return 0; }
+#endif
+
+#endif
@@ -0,0 +1,87 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "trace.h"
+
+#ifdef CONFIG_TURRET_TRACE
+
+#define TRACE_EVENTS		CONFIG_TURRET_TRACE_EVENTS
+#define TRACE_ARG_MASK		0xffffff
+#define TRACE_EVENT_SHIFT	24
+#define TRACE_DUMP_PER_LINE	8
+
+/*
+ * 8 bytes per event: microsecond timestamp (shared by both cores, so
+ * the player task can be ordered against the control loop) and the
+ * event number in the top byte of the argument word.
+ */
+struct trace_record {
+	uint32_t time;
+	uint32_t event;
+};
+
+struct trace_struct {
+	uint32_t head;
+	struct trace_record record[TRACE_EVENTS];
+};
+
+_Static_assert((TRACE_EVENTS & (TRACE_EVENTS - 1)) == 0,
+	       "CONFIG_TURRET_TRACE_EVENTS must be a power of 2");
+
+static struct trace_struct trace[portNUM_PROCESSORS];
+static volatile bool trace_paused;
+
+/*
+ * Lock-free: the slot is reserved with an atomic increment, so tasks
+ * preempting each other or migrating between cores never share one.
+ */
+void trace_event(unsigned event, uint32_t arg)
+{
+	struct trace_struct *t = trace + xPortGetCoreID();
+	struct trace_record *r;
+
+	if (trace_paused)
+		return;
+
+	r = t->record + (__atomic_fetch_add(&t->head, 1, __ATOMIC_RELAXED) &
+			 (TRACE_EVENTS - 1));
+	r->time = esp_timer_get_time();
+	r->event = event << TRACE_EVENT_SHIFT | (arg & TRACE_ARG_MASK);
+}
+
+/*
+ * Print both rings as hex records for tools/tracedec.py:
+ *   TRC <core> <head> <size>
+ *   TRC <core> <time><event> ...
+ *   TRC end
+ */
+void trace_dump(void)
+{
+	int core;
+
+	trace_paused = true;
+	for (core = 0; core < portNUM_PROCESSORS; ++core) {
+		struct trace_struct *t = trace + core;
+		uint32_t head = t->head;
+		uint32_t n = head < TRACE_EVENTS ? head : TRACE_EVENTS;
+		uint32_t i;
+
+		printf("TRC %d %" PRIu32 " %" PRIu32, core, head, n);
+		for (i = 0; i < n; ++i) {
+			const struct trace_record *r =
+				t->record + ((head - n + i) & (TRACE_EVENTS - 1));
+
+			if (i % TRACE_DUMP_PER_LINE == 0)
+				printf("\nTRC %d", core);
+			printf(" %08" PRIx32 "%08" PRIx32, r->time, r->event);
+		}
+		printf("\n");
+	}
+	printf("TRC end\n");
+	trace_paused = false;
+}
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include "sdkconfig.h"
+
+/* Keep in sync with the event table in tools/tracedec.py */
+enum {
+	TRACE_TURRET_STATE,	/* arg: head << 8 | new turret state */
+	TRACE_STABLE_STATE,	/* arg: head << 8 | new stable state */
+	TRACE_STREAM_OPEN,	/* arg: stream id */
+	TRACE_STREAM_CLOSE,	/* arg: stream id */
+	TRACE_I2S_WRITE,	/* arg: bytes written */
+	TRACE_I2S_UNDERRUN,	/* arg: none */
+	TRACE_I2C,		/* arg: register << 16 | esp_err_t & 0xffff */
+	TRACE_SERVO,		/* arg: (head * 2 + timer) << 16 | duty in us */
+	TRACE_N,
+};
+
+#ifdef CONFIG_TURRET_TRACE
+void trace_event(unsigned event, uint32_t arg);
+void trace_dump(void);
+#else
+static inline void trace_event(unsigned event, uint32_t arg) {}
+static inline void trace_dump(void) {}
+#endif
+
+#endif
@@ -1,14 +1,20 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include "driver/mcpwm.h"
 #include "esp_err.h"
+#include "esp_log.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 
+#include "head.h"
+#include "latency.h"
 #include "player.h"
+#include "record.h"
+#include "settings.h"
+#include "trace.h"
 #include "wings.h"
 
-#define GPIO_END_SWITCH		23
-
-#define GPIO_WINGSPAN		32
 #define CHANNEL_WINGSPAN	MCPWM0A
 #define TIMER_WINGSPAN		MCPWM_TIMER_0
 
@@ -18,8 +24,9 @@
 #define WINGSPAN_OPEN_END	1200
 #define WINGSPAN_CLOSE_START	1500
 #define WINGSPAN_CLOSE_END	1600
+/* The wingspan servo turns continuously, at a speed ~ |duty - stop| */
+#define WINGSPAN_STOP		1500
 
-#define GPIO_WINGTURN		33
 #define CHANNEL_WINGTURN	MCPWM1A
 #define TIMER_WINGTURN		MCPWM_TIMER_1
 
@@ -35,6 +42,23 @@
 #define TICKS_CENTERING		MS_TO_TICKS(1000)
 #define TICKS_CLOSE_TIMEOUT	MS_TO_TICKS(5000)
 
+/*
+ * The fixed timings above fit the slowest unit. A close from fully
+ * open measures the servo travel from open to the end switch, which
+ * the opening before covered past the switch release. The tick the
+ * opening ramp covers both is the open time of the unit, later
+ * openings stop a margin after it. Only closes after openings that
+ * ran the fixed time are learned from, so that short openings cannot
+ * shrink the model.
+ */
+#define WINGS_MODEL_KEY		"wings"
+#define WINGS_MODEL_VERSION	3
+#define WINGS_MODEL_MIN		3	/* learned closes before use */
+#define WINGS_RELEARN		16	/* every n-th opening is fixed */
+#define WINGS_DEAD_MARGIN(t)	(2 * (t) + MS_TO_TICKS(200))
+#define WINGS_CLOSE_MARGIN(t)	(2 * (t) + MS_TO_TICKS(500))
+#define WINGS_OPEN_MARGIN(t)	((t) / 8 + MS_TO_TICKS(100))
+
 enum {
 	STATE_INITIAL,
 	STATE_OPENING,
@@ -47,29 +71,43 @@ enum {
 
 struct wings_struct
 {
+	int head;
+	mcpwm_unit_t pwm;
+	gpio_num_t end_switch;
+	int duty[2];		/* last set, by timer */
 	int state;
 	int target;
 	int tick;
 	int angle; /* 0 -- leftmost, WINGTURN_RANGE -- rightmost*/
 	int scan_direction;
 	int last_scan_direction;
+	int elapsed;		/* ticks since closing started */
+	int released;		/* opening tick of switch release, 0 -- not yet */
+	int release_travel;	/* servo speed summed up to the release */
+	int travel;		/* servo speed summed, this opening or close */
+	bool full;		/* this opening runs the fixed time */
+	bool learn;		/* the next close starts from fully open */
+	unsigned openings;
+	struct wings_model model;
+	unsigned fast_openings;
+	int64_t saved_ticks;
 };
 
-static struct wings_struct wings;
+static struct wings_struct wings[HEADS];
 
-static void end_switch_init(void)
+static void end_switch_init(gpio_num_t gpio)
 {
 	gpio_config_t io_conf = {
 		.intr_type = GPIO_INTR_DISABLE,
 		.mode = GPIO_MODE_INPUT,
-		.pin_bit_mask = 1 << GPIO_END_SWITCH,
+		.pin_bit_mask = 1ULL << gpio,
 		.pull_up_en = GPIO_PULLUP_ENABLE,
 	};
 
 	gpio_config(&io_conf);
 }
 
-static void servo_init(int gpio, int channel, int timer)
+static void servo_init(mcpwm_unit_t unit, int gpio, int channel, int timer)
 {
 	mcpwm_config_t pwm_config = {
 		.frequency = 50,
@@ -78,13 +116,19 @@ static void servo_init(int gpio, int channel, int timer)
 		.duty_mode = MCPWM_DUTY_MODE_0,
 	};
 
-	mcpwm_gpio_init(MCPWM_UNIT_0, channel, gpio);
-	mcpwm_init(MCPWM_UNIT_0, timer, &pwm_config);
+	mcpwm_gpio_init(unit, channel, gpio);
+	mcpwm_init(unit, timer, &pwm_config);
 }
 
-static void servo_set_duty(int timer, int us)
+/* The servo latency is the first change of duty, not the first write */
+static void servo_set_duty(struct wings_struct *w, int timer, int us)
 {
-	mcpwm_set_duty_in_us(MCPWM_UNIT_0, timer, MCPWM_OPR_A, us);
+	if (us != w->duty[timer]) {
+		w->duty[timer] = us;
+		latency_response(LATENCY_SERVO);
+	}
+	trace_event(TRACE_SERVO, (w->head * 2 + timer) << 16 | us);
+	mcpwm_set_duty_in_us(w->pwm, timer, MCPWM_OPR_A, us);
 }
 
 static int interpolate(int t, int dt, int start, int end)
@@ -92,146 +136,312 @@ static int interpolate(int t, int dt, int start, int end)
 	return t < dt ? (start * (dt - t) + end * t) / dt : end;
 }
 
-static void wings_set_turn(void)
+static void wings_set_turn(struct wings_struct *w)
 {
-	servo_set_duty(TIMER_WINGTURN,
-		       interpolate(wings.angle, WINGTURN_RANGE,
+	servo_set_duty(w, TIMER_WINGTURN,
+		       interpolate(w->angle, WINGTURN_RANGE,
 				   WINGTURN_LEFT, WINGTURN_RIGHT));
 }
 
-static void wings_broken(void)
+static int ewma16(int32_t avg16, int sample, bool first)
+{
+	return first ? sample * 16 : avg16 + (sample * 16 - avg16) / 4;
+}
+
+static bool wings_model_valid(struct wings_struct *w)
+{
+	return w->model.n >= WINGS_MODEL_MIN;
+}
+
+static int wings_dead_ticks(struct wings_struct *w)
 {
-	wings.state = STATE_BROKEN;
-	servo_set_duty(TIMER_WINGSPAN, 0);
-	servo_set_duty(TIMER_WINGTURN, 0);
+	int t;
+
+	if (!wings_model_valid(w))
+		return TICKS_OPENING_DEAD;
+	t = WINGS_DEAD_MARGIN(w->model.release16 / 16);
+	return t < TICKS_OPENING_DEAD ? t : TICKS_OPENING_DEAD;
+}
+
+static bool wings_close_timeout(struct wings_struct *w)
+{
+	return wings_model_valid(w) &&
+		w->elapsed > WINGS_CLOSE_MARGIN(w->model.close16 / 16);
+}
+
+static int wings_open_duty(int tick)
+{
+	return interpolate(tick, WINGSPAN_RAMP_TIME,
+			   WINGSPAN_OPEN_START, WINGSPAN_OPEN_END);
+}
+
+/* Ticks the opening ramp takes to cover travel */
+static int wings_open_ticks(int travel)
+{
+	int tick = 0;
+
+	while (travel > 0 && tick < TICKS_OPENING)
+		travel -= abs(wings_open_duty(++tick) - WINGSPAN_STOP);
+	return tick;
+}
+
+static bool wings_open_done(struct wings_struct *w)
+{
+	int t = w->model.open16 / 16;
+
+	return !w->full && wings_model_valid(w) &&
+		w->tick >= t + WINGS_OPEN_MARGIN(t);
+}
+
+static void wings_opening_done(struct wings_struct *w)
+{
+	struct wings_model *m = &w->model;
+
+	if (w->released)
+		m->release16 = ewma16(m->release16, w->released,
+				      !m->release16);
+	w->learn = w->full && w->released;
+	if (!w->full) {
+		++w->fast_openings;
+		w->saved_ticks += TICKS_OPENING - w->tick;
+	}
+}
+
+static void wings_closing_done(struct wings_struct *w)
+{
+	struct wings_model *m = &w->model;
+	char key[SETTINGS_KEY_SIZE];
+	int open;
+
+	if (!w->learn)
+		return;
+	w->learn = false;
+	open = wings_open_ticks(w->release_travel + w->travel);
+	m->close16 = ewma16(m->close16, w->elapsed, !m->n);
+	m->open16 = ewma16(m->open16, open, !m->n);
+	++m->n;
+	settings_head_key(key, WINGS_MODEL_KEY, w->head);
+	settings_save(key, m, sizeof(*m));
 }
 
-static void wings_closing(void)
+static void wings_close_start(struct wings_struct *w)
 {
-	if (wings_closed()) {
-		wings.state = STATE_CLOSED;
-	} else if (wings_opened()) {
-		wings.state = STATE_CENTERING;
-		servo_set_duty(TIMER_WINGSPAN, WINGSPAN_NEUTRAL);
-		wings_set_turn();
+	w->state = STATE_CLOSING;
+	servo_set_duty(w, TIMER_WINGSPAN, WINGSPAN_CLOSE_START);
+	w->tick = 0;
+	w->elapsed = 0;
+	w->travel = 0;
+}
+
+static void wings_broken(struct wings_struct *w)
+{
+	w->state = STATE_BROKEN;
+	servo_set_duty(w, TIMER_WINGSPAN, 0);
+	servo_set_duty(w, TIMER_WINGTURN, 0);
+}
+
+static void wings_closing(struct wings_struct *w)
+{
+	if (wings_closed(w)) {
+		w->state = STATE_CLOSED;
+	} else if (wings_opened(w)) {
+		w->state = STATE_CENTERING;
+		servo_set_duty(w, TIMER_WINGSPAN, WINGSPAN_NEUTRAL);
+		wings_set_turn(w);
 	} else {
-		wings.state = STATE_CLOSING;
-		servo_set_duty(TIMER_WINGSPAN, WINGSPAN_CLOSE_START);
-		wings.tick = 0;
+		/* Not from fully open */
+		w->learn = false;
+		wings_close_start(w);
 	}
 }
 
+static void wings_head_init(struct wings_struct *w, int head)
+{
+	const struct head_config *cfg = head_config + head;
+	char key[SETTINGS_KEY_SIZE];
+
+	w->head = head;
+	w->pwm = cfg->pwm;
+	w->end_switch = cfg->end_switch;
+	servo_init(w->pwm, cfg->wingspan, CHANNEL_WINGSPAN, TIMER_WINGSPAN);
+	servo_init(w->pwm, cfg->wingturn, CHANNEL_WINGTURN, TIMER_WINGTURN);
+	servo_set_duty(w, TIMER_WINGSPAN, WINGSPAN_NEUTRAL);
+	servo_set_duty(w, TIMER_WINGTURN, WINGTURN_CENTER);
+	end_switch_init(w->end_switch);
+	settings_head_key(key, WINGS_MODEL_KEY, head);
+	if (!settings_load(key, &w->model, sizeof(w->model)))
+		w->model.version = 0;
+	wings_model_set(w, &w->model);
+	w->angle = WINGTURN_RANGE / 2;
+	w->scan_direction = -1;
+	wings_closing(w);
+}
+
 void wings_init(void)
 {
-	servo_init(GPIO_WINGSPAN, CHANNEL_WINGSPAN, TIMER_WINGSPAN);
-	servo_init(GPIO_WINGTURN, CHANNEL_WINGTURN, TIMER_WINGTURN);
-	servo_set_duty(TIMER_WINGSPAN, WINGSPAN_NEUTRAL);
-	servo_set_duty(TIMER_WINGTURN, WINGTURN_CENTER);
-	end_switch_init();
-	wings.angle = WINGTURN_RANGE / 2;
-	wings.scan_direction = -1;
-	wings_closing();
+	int i;
+
+	for (i = 0; i < HEADS; ++i)
+		wings_head_init(wings + i, i);
+}
+
+struct wings_struct *wings_head(int head)
+{
+	return wings + head;
+}
+
+void wings_model_get(struct wings_struct *w, struct wings_model *m)
+{
+	*m = w->model;
+}
+
+/* Unknown versions start over, replays start from the recorded model */
+void wings_model_set(struct wings_struct *w, const struct wings_model *m)
+{
+	if (m->version == WINGS_MODEL_VERSION)
+		w->model = *m;
+	else
+		w->model = (struct wings_model){ .version = WINGS_MODEL_VERSION };
 }
 
-void wings_open(bool open)
+void wings_open(struct wings_struct *w, bool open)
 {
 	if (open)
-		wings.target = STATE_OPEN;
+		w->target = STATE_OPEN;
 	else
-		wings.target = STATE_CLOSED;
+		w->target = STATE_CLOSED;
 }
 
-void wings_scan(bool on)
+void wings_scan(struct wings_struct *w, bool on)
 {
 	if (on) {
-		wings.scan_direction = wings.last_scan_direction;
-		if (!wings.scan_direction)
-			wings.scan_direction = 1;
+		w->scan_direction = w->last_scan_direction;
+		if (!w->scan_direction)
+			w->scan_direction = 1;
 	} else {
-		wings.last_scan_direction = wings.scan_direction;
-		wings.scan_direction = 0;
+		w->last_scan_direction = w->scan_direction;
+		w->scan_direction = 0;
 	}
 }
 
-bool wings_opened(void)
+bool wings_opened(struct wings_struct *w)
 {
-	return wings.state == STATE_OPEN;
+	return w->state == STATE_OPEN;
 }
 
-bool wings_closed(void)
+bool wings_closed(struct wings_struct *w)
 {
-	return !gpio_get_level(GPIO_END_SWITCH);
+	return !record_end_switch(gpio_get_level(w->end_switch));
 }
 
-void wings_tick(void)
+void wings_tick(struct wings_struct *w)
 {
-	switch (wings.state) {
+	int duty;
+
+	switch (w->state) {
 	case STATE_OPENING:
-		++wings.tick;
-		servo_set_duty(TIMER_WINGSPAN,
-			       interpolate(wings.tick, WINGSPAN_RAMP_TIME,
-					   WINGSPAN_OPEN_START, WINGSPAN_OPEN_END));
-		if (wings.target == STATE_CLOSED) {
-			wings_closing();
-		} else if (wings.tick >= TICKS_OPENING_DEAD && wings_closed()) {
-			wings_broken();
-		} else if (wings.tick >= TICKS_OPENING) {
-			wings.state = STATE_OPEN;
-			servo_set_duty(TIMER_WINGSPAN, WINGSPAN_NEUTRAL);
+		duty = wings_open_duty(++w->tick);
+		servo_set_duty(w, TIMER_WINGSPAN, duty);
+		w->travel += abs(duty - WINGSPAN_STOP);
+		if (!w->released && !wings_closed(w)) {
+			w->released = w->tick;
+			w->release_travel = w->travel;
+		}
+		if (w->target == STATE_CLOSED) {
+			wings_closing(w);
+		} else if (w->tick >= wings_dead_ticks(w) && wings_closed(w)) {
+			wings_broken(w);
+		} else if (w->tick >= TICKS_OPENING || wings_open_done(w)) {
+			wings_opening_done(w);
+			w->state = STATE_OPEN;
+			servo_set_duty(w, TIMER_WINGSPAN, WINGSPAN_NEUTRAL);
 		}
 		break;
 
 	case STATE_OPEN:
-		if (wings.target == STATE_CLOSED) {
-			wings_closing();
-		} else if (wings.scan_direction) {
-			wings.angle += wings.scan_direction;
-			if (wings.angle < 0) {
-				wings.angle = 0;
-				wings.scan_direction = 1;
-			} else if (wings.angle > WINGTURN_RANGE) {
-				wings.angle = WINGTURN_RANGE;
-				wings.scan_direction = -1;
+		if (w->target == STATE_CLOSED) {
+			wings_closing(w);
+		} else if (w->scan_direction) {
+			w->angle += w->scan_direction;
+			if (w->angle < 0) {
+				w->angle = 0;
+				w->scan_direction = 1;
+			} else if (w->angle > WINGTURN_RANGE) {
+				w->angle = WINGTURN_RANGE;
+				w->scan_direction = -1;
 			}
-			wings_set_turn();
+			wings_set_turn(w);
 		}
 		break;
 
 	case STATE_CENTERING:
-		if (wings.target == STATE_OPEN) {
-			wings.state = wings.target;
-		} else if (wings.angle == WINGTURN_RANGE / 2) {
-			wings.state = STATE_CLOSING;
-			servo_set_duty(TIMER_WINGSPAN, WINGSPAN_CLOSE_START);
-			wings.tick = 0;
+		if (w->target == STATE_OPEN) {
+			w->state = w->target;
+		} else if (w->angle == WINGTURN_RANGE / 2) {
+			wings_close_start(w);
 		} else {
-			if (wings.angle > WINGTURN_RANGE / 2)
-				--wings.angle;
+			if (w->angle > WINGTURN_RANGE / 2)
+				--w->angle;
 			else
-				++wings.angle;
-			wings_set_turn();
+				++w->angle;
+			wings_set_turn(w);
 		}
 		break;
 
 	case STATE_CLOSING:
-		++wings.tick;
-		servo_set_duty(TIMER_WINGSPAN,
-			       interpolate(wings.tick, WINGSPAN_RAMP_TIME,
-					   WINGSPAN_CLOSE_START, WINGSPAN_CLOSE_END));
-		if (wings_closed()) {
-			wings.state = STATE_CLOSED;
-			servo_set_duty(TIMER_WINGSPAN, WINGSPAN_NEUTRAL);
-		} else if (++wings.tick > TICKS_CLOSE_TIMEOUT) {
-			wings_broken();
+		++w->tick;
+		++w->elapsed;
+		duty = interpolate(w->tick, WINGSPAN_RAMP_TIME,
+				   WINGSPAN_CLOSE_START, WINGSPAN_CLOSE_END);
+		servo_set_duty(w, TIMER_WINGSPAN, duty);
+		w->travel += abs(duty - WINGSPAN_STOP);
+		if (wings_closed(w)) {
+			wings_closing_done(w);
+			w->state = STATE_CLOSED;
+			servo_set_duty(w, TIMER_WINGSPAN, WINGSPAN_NEUTRAL);
+		} else if (++w->tick > TICKS_CLOSE_TIMEOUT ||
+			   wings_close_timeout(w)) {
+			wings_broken(w);
 		}
 		break;
 
 	case STATE_CLOSED:
-		if (wings.target == STATE_OPEN) {
-			wings.state = STATE_OPENING;
-			servo_set_duty(TIMER_WINGSPAN, WINGSPAN_OPEN_START);
-			wings.tick = 0;
+		if (w->target == STATE_OPEN) {
+			w->state = STATE_OPENING;
+			servo_set_duty(w, TIMER_WINGSPAN, WINGSPAN_OPEN_START);
+			w->tick = 0;
+			w->released = 0;
+			w->travel = 0;
+			w->full = !wings_model_valid(w) ||
+				!(++w->openings % WINGS_RELEARN);
 		}
 		break;
 	}
 }
+
+static void wings_head_stat(struct wings_struct *w)
+{
+	const struct wings_model *m = &w->model;
+
+	printf("learned closes: %" PRIu32 "%s\n", m->n,
+	       wings_model_valid(w) ? "" : ", fixed timing");
+	if (m->n)
+		printf("switch release %d ms, open %d ms, close %d ms\n",
+		       (int)m->release16 * 10 / 16, (int)m->open16 * 10 / 16,
+		       (int)m->close16 * 10 / 16);
+	printf("open in %d ms fixed, %u openings faster by %d ms on average\n",
+	       TICKS_OPENING * 10, w->fast_openings,
+	       w->fast_openings ?
+	       (int)(w->saved_ticks * 10 / w->fast_openings) : 0);
+}
+
+void wings_stat(void)
+{
+	int i;
+
+	for (i = 0; i < HEADS; ++i) {
+		if (HEADS > 1)
+			printf("head %d:\n", i);
+		wings_head_stat(wings + i);
+	}
+}
@@ -1,11 +1,29 @@
 #ifndef WINGS_H
 #define WINGS_H
 
+#include <stdbool.h>
+#include <stdint.h>
+
+struct wings_struct;
+
+/* Running averages, ticks in 1/16 */
+struct wings_model {
+	uint32_t version;
+	uint32_t n;		/* learned closes */
+	int32_t release16;	/* open start to end switch release */
+	int32_t close16;	/* close start to end switch press */
+	int32_t open16;		/* open start to fully open */
+};
+
 void wings_init(void);
-void wings_open(bool open);
-void wings_scan(bool on);
-bool wings_opened(void);
-bool wings_closed(void);
-void wings_tick(void);
+struct wings_struct *wings_head(int head);
+void wings_open(struct wings_struct *w, bool open);
+void wings_scan(struct wings_struct *w, bool on);
+bool wings_opened(struct wings_struct *w);
+bool wings_closed(struct wings_struct *w);
+void wings_tick(struct wings_struct *w);
+void wings_model_get(struct wings_struct *w, struct wings_model *m);
+void wings_model_set(struct wings_struct *w, const struct wings_model *m);
+void wings_stat(void);
 
 #endif
@@ -0,0 +1,140 @@
+#!/usr/bin/env python3
+#
+# Check the behaviour tables in main/behaviour.def: every state and cue
+# group a rule or prefetch list names exists, every state is reachable
+# from the initial one and has a way out, the rules of a state are
+# together and none is shadowed by an earlier unconditional rule of the
+# same state. Clips are checked by cuegen.py.
+#
+# Usage: behaviour.py [--stamp file] main/behaviour.def
+#
+# Lists every error found and exits with 1 if there is any.
+
+import argparse
+import re
+import sys
+
+ENTRY = re.compile(r'^(CUES|TURRET|STABLE|RULE)\((.*)\)\s*$')
+
+
+def split(args):
+    return [a.strip() for a in re.findall(r'"[^"]*"|[^,]+', args)]
+
+
+def parse(path):
+    cues = {}
+    states = {'TURRET': [], 'STABLE': []}
+    prefetch = {}
+    subs = set()
+    rules = []
+    with open(path) as f:
+        for n, line in enumerate(f, 1):
+            m = ENTRY.match(line)
+            if not m:
+                continue
+            kind, args = m.group(1), split(m.group(2))
+            where = '%s:%d' % (path, n)
+            if kind == 'CUES':
+                cues[args[0]] = where
+            elif kind == 'TURRET':
+                states[kind].append(args[0])
+                prefetch[(kind, args[0])] = (args[4:], where)
+                if args[3] != '0':
+                    subs.add(args[0])
+            elif kind == 'STABLE':
+                states[kind].append(args[0])
+                prefetch[(kind, args[0])] = (args[2:], where)
+            else:
+                rules.append(dict(zip(('machine', 'state', 'set', 'clear',
+                                       'after', 'chance', 'next',
+                                       'actions', 'cue'), args),
+                                  where=where))
+    return cues, states, prefetch, subs, rules
+
+
+def unconditional(rule):
+    return (rule['set'] == '0' and rule['clear'] == '0' and
+            rule['chance'] == '100')
+
+
+def check(cues, states, prefetch, subs, rules):
+    errors = []
+
+    for (machine, state), (groups, where) in prefetch.items():
+        for g in groups:
+            if g != 'NONE' and g not in cues:
+                errors.append('%s: unknown cue group %s' % (where, g))
+
+    for r in rules:
+        machine = r['machine']
+        if machine not in states:
+            errors.append('%s: unknown machine %s' % (r['where'], machine))
+            continue
+        if r['state'] not in states[machine]:
+            errors.append('%s: unknown state %s' % (r['where'], r['state']))
+        if r['next'] != 'SAME' and r['next'] not in states[machine]:
+            errors.append('%s: unknown state %s' % (r['where'], r['next']))
+        if r['cue'] != 'NONE' and r['cue'] not in cues:
+            errors.append('%s: unknown cue group %s' % (r['where'], r['cue']))
+        if not 0 < int(r['chance']) <= 100:
+            errors.append('%s: chance out of range' % r['where'])
+
+    if states['STABLE'] and not subs:
+        errors.append('no TURRET state runs the STABLE machine')
+
+    for machine, names in states.items():
+        if not names:
+            continue
+        own = [r for r in rules if r['machine'] == machine]
+        # app_main.c indexes the rules of a state as one run
+        runs = [r['state'] for i, r in enumerate(own)
+                if not i or own[i - 1]['state'] != r['state']]
+        for s in names:
+            if runs.count(s) > 1:
+                errors.append('%s: rules of state %s are not together'
+                              % (machine, s))
+        for s in names:
+            if not any(r['state'] == s for r in own):
+                errors.append('%s: state %s has no rules' % (machine, s))
+            after = None
+            for r in own:
+                if r['state'] != s:
+                    continue
+                if after is not None and int(r['after']) >= after:
+                    errors.append('%s: shadowed by an earlier rule of %s'
+                                  % (r['where'], s))
+                if unconditional(r):
+                    after = int(r['after']) if after is None else \
+                        min(after, int(r['after']))
+        seen = {names[0]}
+        todo = [names[0]]
+        while todo:
+            s = todo.pop()
+            for r in own:
+                if r['state'] == s and r['next'] not in ('SAME', *seen):
+                    seen.add(r['next'])
+                    todo.append(r['next'])
+        for s in names:
+            if s not in seen:
+                errors.append('%s: state %s is unreachable' % (machine, s))
+
+    return errors
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--stamp')
+    parser.add_argument('def_file')
+    args = parser.parse_args()
+
+    errors = check(*parse(args.def_file))
+    for e in errors:
+        print('error: ' + e, file=sys.stderr)
+    if errors:
+        sys.exit(1)
+    if args.stamp:
+        open(args.stamp, 'w').close()
+
+
+if __name__ == '__main__':
+    main()
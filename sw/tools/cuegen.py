@@ -0,0 +1,136 @@
+#!/usr/bin/env python3
+#
+# Generate the cue ID header from the CUES entries of main/behaviour.def
+# and the clip sources in the audio directory. Every clip gets a CLIP_*
+# ID and its source duration, every group a CUE_* ID, its clips and
+# their number. A clip without a source fails the build.
+#
+# Usage: cuegen.py [--audio ../audio] -o cue_ids.h main/behaviour.def
+#        cuegen.py --list main/behaviour.def
+#
+# --list prints the clip sources relative to the audio directory, one
+# per line, for convert-audio.sh.
+
+import argparse
+import os
+import re
+import sys
+
+CUES = re.compile(r'^CUES\((\w+),(.*)\)\s*$')
+
+# MPEG audio version and layer III tables, indexed by header fields
+BITRATE = {
+    1: [0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320],
+    2: [0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160],
+}
+RATE = {
+    1: [44100, 48000, 32000],
+    2: [22050, 24000, 16000],
+    2.5: [11025, 12000, 8000],
+}
+VERSION = {3: 1, 2: 2, 0: 2.5}
+
+
+def parse(path):
+    groups = []
+    with open(path) as f:
+        for n, line in enumerate(f, 1):
+            m = CUES.match(line)
+            if m:
+                clips = re.findall(r'"([^"]*)"', m.group(2))
+                groups.append((m.group(1), clips, '%s:%d' % (path, n)))
+    return groups
+
+
+def duration_ms(path):
+    """Length of an MPEG layer III file, summed over its frames"""
+    with open(path, 'rb') as f:
+        data = f.read()
+    pos = 0
+    if data[:3] == b'ID3':
+        pos = 10 + (data[6] << 21 | data[7] << 14 | data[8] << 7 | data[9])
+    samples = 0.0
+    while pos + 4 <= len(data):
+        h = int.from_bytes(data[pos:pos + 4], 'big')
+        version = VERSION.get(h >> 19 & 3)
+        bitrate = h >> 12 & 15
+        rate = h >> 10 & 3
+        if (h >> 21 != 0x7ff or not version or h >> 17 & 3 != 1 or
+                bitrate in (0, 15) or rate == 3):
+            pos += 1
+            continue
+        rate = RATE[version][rate]
+        bitrate = BITRATE[1 if version == 1 else 2][bitrate] * 1000
+        scale = 144 if version == 1 else 72
+        pos += scale * bitrate // rate + (h >> 9 & 1)
+        samples += (1152 if version == 1 else 576) / rate
+    return int(samples * 1000)
+
+
+def ident(clip):
+    return 'CLIP_' + re.sub(r'\W', '_', re.sub(r'\.mp3$', '', clip)).upper()
+
+
+def generate(groups, audio):
+    clips = []
+    errors = []
+    for group, members, where in groups:
+        if not members:
+            errors.append('%s: cue group %s is empty' % (where, group))
+        for c in members:
+            if not os.path.isfile(os.path.join(audio, c)):
+                errors.append('%s: %s has no source in %s'
+                              % (where, c, audio))
+            elif c not in clips:
+                clips.append(c)
+    if len(clips) > 255:
+        errors.append('more than 255 clips')
+    if errors:
+        return None, errors
+
+    out = ['/* Generated by tools/cuegen.py from behaviour.def, do not edit */',
+           '#ifndef CUE_IDS_H', '#define CUE_IDS_H', '', 'enum {']
+    out += ['\t%s,' % ident(c) for c in clips]
+    out += ['\tCLIP_N,', '};', '', 'enum {', '\tCUE_NONE,']
+    out += ['\tCUE_%s,' % g for g, _, _ in groups]
+    out += ['\tCUE_N,', '};', '']
+    out += ['#define CUE_%s_N\t%d' % (g, len(m)) for g, m, _ in groups]
+    out += ['', '/* X(clip, path, source duration in ms) */',
+            '#define CUE_CLIPS(X) \\']
+    out += ['\tX(%s, "/audio/%s.s8", %d) \\'
+            % (ident(c), c, duration_ms(os.path.join(audio, c)))
+            for c in clips]
+    out += ['', '/* X(group, clips...) */', '#define CUE_GROUPS(X) \\']
+    out += ['\tX(CUE_%s, %s) \\' % (g, ', '.join(ident(c) for c in m))
+            for g, m, _ in groups]
+    out += ['', '#endif', '']
+    return '\n'.join(out), []
+
+
+def main():
+    here = os.path.dirname(os.path.abspath(__file__))
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--audio',
+                        default=os.path.join(here, '..', '..', 'audio'))
+    parser.add_argument('--list', action='store_true')
+    parser.add_argument('-o', '--output')
+    parser.add_argument('def_file')
+    args = parser.parse_args()
+
+    groups = parse(args.def_file)
+    if args.list:
+        for c in sorted({c for _, m, _ in groups for c in m}):
+            print(c)
+        return
+
+    text, errors = generate(groups, args.audio)
+    for e in errors:
+        print('error: ' + e, file=sys.stderr)
+    if errors:
+        sys.exit(1)
+    with open(args.output, 'w') as f:
+        f.write(text)
+
+
+if __name__ == '__main__':
+    main()
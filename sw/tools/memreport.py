@@ -0,0 +1,151 @@
+#!/usr/bin/env python3
+#
+# Per-module static memory use from the linker map, checked against
+# the budgets in memory-budget.txt. Objects of the main component are
+# listed one by one, everything else per library.
+#
+# Usage: memreport.py [--budget memory-budget.txt] build/turret.map
+#
+# Exits with 1 when a budget is exceeded or names no module. Main
+# component sources are named "<name>.c" whether the map comes from
+# idf.py ("accel.c.obj") or make ("accel.o"), and may be budgeted while
+# a configuration leaves them out of the link.
+
+import argparse
+import collections
+import os
+import re
+import sys
+
+# Output sections by the memory they take
+REGIONS = collections.OrderedDict([
+    ('dram', ('.dram0.data', '.dram0.bss', '.noinit')),
+    ('iram', ('.iram0.vectors', '.iram0.text', '.iram0.data', '.iram0.bss')),
+    ('flash', ('.flash.appdesc', '.flash.text', '.flash.rodata')),
+])
+
+SECTION = {s: r for r, sections in REGIONS.items() for s in sections}
+
+INPUT = re.compile(r'^ (\S+)?\s+0x([0-9a-f]+)\s+0x([0-9a-f]+)\s+(\S.*)$')
+MAIN = 'libmain.a'
+
+
+def module(path):
+    """Module name of an input file and whether it is a main source"""
+    m = re.match(r'(.*)\((.*)\)$', path)
+    if not m:
+        return os.path.basename(path), False
+    lib = os.path.basename(m.group(1))
+    if lib == MAIN:
+        obj = m.group(2)
+        if obj.endswith('.obj'):
+            return obj[:-len('.obj')], True
+        return re.sub(r'\.o$', '.c', obj), True
+    return lib, False
+
+
+def parse(lines):
+    usage = collections.defaultdict(lambda: dict.fromkeys(REGIONS, 0))
+    main = set()
+    region = None
+    pending = None
+    started = False
+    for line in lines:
+        line = line.rstrip('\n')
+        if not started:
+            started = line.startswith('Linker script and memory map')
+            continue
+        if line.startswith('.') or line.startswith('/DISCARD/'):
+            region = SECTION.get(line.split()[0])
+            continue
+        if region is None:
+            continue
+        # long input section names push the rest onto the next line
+        if pending is not None:
+            line = ' ' + pending + line
+            pending = None
+        elif re.match(r'^ \S+$', line):
+            pending = line.strip()
+            continue
+        m = INPUT.match(line)
+        if not m or m.group(1) == '*fill*':
+            continue
+        size = int(m.group(3), 16)
+        if size and int(m.group(2), 16):
+            name, is_main = module(m.group(4))
+            usage[name][region] += size
+            if is_main:
+                main.add(name)
+    return usage, main
+
+
+def read_budget(name):
+    budget = {}
+    with open(name) as f:
+        for line in f:
+            w = line.split('#')[0].split()
+            if not w:
+                continue
+            budget[w[0]] = {r: None if v == '-' else int(v, 0)
+                            for r, v in zip(REGIONS, w[1:])}
+    return budget
+
+
+def main():
+    p = argparse.ArgumentParser()
+    p.add_argument('--budget')
+    p.add_argument('--sources',
+                   help='main component directory, default main/ next '
+                   'to the budget')
+    p.add_argument('map')
+    args = p.parse_args()
+
+    with open(args.map) as f:
+        usage, main_modules = parse(f)
+
+    total = dict.fromkeys(REGIONS, 0)
+    main_total = dict.fromkeys(REGIONS, 0)
+    for name, u in usage.items():
+        for r in REGIONS:
+            total[r] += u[r]
+            if name in main_modules:
+                main_total[r] += u[r]
+    usage['total'] = total
+    usage[MAIN] = main_total
+
+    fmt = '%-28s' + ' %8s' * len(REGIONS)
+    print(fmt % (('module',) + tuple(REGIONS)))
+    for name, u in sorted(usage.items(),
+                          key=lambda i: (i[0] != 'total', i[0] != MAIN,
+                                         i[0].endswith('.a'),
+                                         -i[1]['dram'] - i[1]['iram'],
+                                         i[0])):
+        if any(u.values()):
+            print(fmt % ((name,) + tuple(u[r] for r in REGIONS)))
+
+    if not args.budget:
+        return 0
+
+    sources = args.sources or os.path.join(os.path.dirname(args.budget),
+                                           'main')
+    known = set(usage)
+    if os.path.isdir(sources):
+        known.update(os.listdir(sources))
+
+    fail = False
+    for name, b in sorted(read_budget(args.budget).items()):
+        if name not in known:
+            print('%s: budget matches no module' % name, file=sys.stderr)
+            fail = True
+            continue
+        u = usage.get(name, dict.fromkeys(REGIONS, 0))
+        for r, limit in b.items():
+            if limit is not None and u[r] > limit:
+                print('%s: %s %d bytes over the budget of %d' %
+                      (name, r, u[r] - limit, limit), file=sys.stderr)
+                fail = True
+    return 1 if fail else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,238 @@
+#!/usr/bin/env python3
+#
+# Decode a dump of the turret "record" partition, see sw/main/record.c.
+#
+#   parttool.py -p /dev/ttyUSB0 read_partition --partition-name record \
+#       --output record.bin
+#   recdec.py record.bin             # list sessions
+#   recdec.py record.bin 1 > s.csv   # per-tick inputs of the newest session
+#   recdec.py record.bin 1 --tilt [x,y,z,noise]
+#       compare when the fixed and the calibrated tilt detectors of
+#       sw/main/accel.c trip; by default with the calibration recorded
+#       in the session, or the first quiet samples of an uncalibrated
+#       session
+
+import struct
+import sys
+
+SECTOR_SIZE = 4096
+MAGIC = 0x32455254
+# magic, seq, seed, flags, struct accel_cal, struct wings_model
+HEADER = struct.Struct('<IIII I3ii IIiii')
+FLAG_SESSION = 0x1
+END = 0xff
+SAME, NIBBLE, BYTE, RAW = range(4)
+
+
+def sectors(image):
+    out = []
+    for i in range(len(image) // SECTOR_SIZE):
+        magic, seq, seed, flags = HEADER.unpack_from(image,
+                                                     i * SECTOR_SIZE)[:4]
+        if magic == MAGIC:
+            out.append((seq, i, seed, flags))
+    out.sort()
+    return out
+
+
+def recorded_cal(image, session):
+    """Calibration at the start of the session as x,y,z,noise, if any"""
+    h = HEADER.unpack_from(image, session[0][1] * SECTOR_SIZE)
+    return list(h[5:9]) if h[4] else None
+
+
+def sessions(image):
+    # list of runs of consecutive sectors, split at session starts
+    out = []
+    prev = None
+    for s in sectors(image):
+        if prev is None or s[0] != prev + 1 or s[3] & FLAG_SESSION:
+            out.append([])
+        out[-1].append(s)
+        prev = s[0]
+    return out
+
+
+def nibble(v):
+    return v - 16 if v & 8 else v
+
+
+def byte(v):
+    return v - 256 if v & 0x80 else v
+
+
+def decode(image, session):
+    tick = 0
+    accel = [0, 0, 0]
+    for seq, i, seed, flags in session:
+        data = image[i * SECTOR_SIZE:(i + 1) * SECTOR_SIZE]
+        pos = HEADER.size
+        yield ('seed', tick, seed)
+        while pos < len(data) and data[pos] != END:
+            b = data[pos]
+            pos += 1
+            levels = (b & 1, (b >> 1) & 1)
+            mode = (b >> 2) & 3
+            repeat = 0
+            if mode == SAME:
+                repeat = b >> 4
+            elif mode == NIBBLE:
+                accel[0] += nibble(data[pos] & 0xf)
+                accel[1] += nibble(data[pos] >> 4)
+                accel[2] += nibble(data[pos + 1] & 0xf)
+                pos += 2
+            elif mode == BYTE:
+                for a in range(3):
+                    accel[a] += byte(data[pos + a])
+                pos += 3
+            else:
+                accel = list(struct.unpack_from('<hhh', data, pos))
+                pos += 6
+            for r in range(repeat + 1):
+                yield ('tick', tick, levels, tuple(accel))
+                tick += 1
+
+
+# Keep in sync with sw/main/accel.c
+N_LOG = 128
+N_SHORT = 16
+N_WARMUP = 10
+G_Z = -210
+G_2 = G_Z * G_Z
+CAL_SIGMAS = 6
+CAL_MIN_DEV = 4
+CAL_MAX_NOISE = 64
+
+
+def cdiv(a, b):
+    return int(a / b)
+
+
+def tilted(g):
+    """More than 60 degrees from normal"""
+    d = g[:2] + [g[2] - G_Z]
+    return sum(v * v for v in d) > G_2
+
+
+class Tilt:
+    def __init__(self, cal=None):
+        self.log = [(0, 0, 0)] * N_LOG
+        self.idx = 0
+        self.tick = 0
+        self.warmup = N_WARMUP
+        self.cal = cal
+        if cal:
+            g = [cdiv(v, 16) for v in cal[:3]]
+            self.log = [tuple(g)] * N_LOG
+            self.tick = N_LOG
+            dev = CAL_MIN_DEV * N_SHORT
+            self.threshold_2 = max(CAL_SIGMAS ** 2 * cal[3] * N_SHORT,
+                                   dev * dev)
+            self.g_2 = sum(v * v for v in g)
+
+    def sample(self, o):
+        if self.warmup:
+            self.warmup -= 1
+            return
+        self.tick = min(self.tick + 1, N_LOG)
+        self.log[self.idx] = o
+        self.idx = (self.idx + 1) % N_LOG
+
+    def sums(self, n):
+        return [sum(self.log[(self.idx - 1 - i) % N_LOG][a]
+                    for i in range(n)) for a in range(3)]
+
+    def uneven(self):
+        avg = [cdiv(v, N_LOG) for v in self.sums(N_LOG)]
+        if self.cal:
+            g = [cdiv(v, 16) for v in self.cal[:3]]
+            d = [avg[a] - g[a] for a in range(3)]
+            return 2 * sum(v * v for v in d) > self.g_2
+        return tilted(avg)
+
+    def unstable(self):
+        if self.cal:
+            long = self.sums(N_LOG)
+            r = [v - cdiv(l, N_LOG // N_SHORT)
+                 for v, l in zip(self.sums(N_SHORT), long)]
+            avg = [cdiv(v, N_LOG) for v in long]
+            return sum(v * v for v in r) > self.threshold_2 or \
+                abs(sum(v * v for v in avg) - self.g_2) > self.g_2 // 32 or \
+                self.uneven()
+        if self.tick < N_LOG:
+            return False
+        avg = [cdiv(v, N_LOG) for v in self.sums(N_LOG)]
+        return abs(sum(v * v for v in avg) - G_2) > G_2 // 32 or \
+            self.uneven()
+
+
+def calibrate(samples):
+    """Resting vector and noise of the first quiet N_LOG samples"""
+    for start in range(N_WARMUP, len(samples) - N_LOG, N_LOG):
+        w = samples[start:start + N_LOG]
+        s = [sum(o[a] for o in w) for a in range(3)]
+        noise = sum(N_LOG * sum(o[a] ** 2 for o in w) - s[a] ** 2
+                    for a in range(3)) // (N_LOG * N_LOG)
+        mean = [cdiv(v, N_LOG) for v in s]
+        g_2 = sum(v * v for v in mean)
+        if noise <= CAL_MAX_NOISE and abs(g_2 - G_2) <= G_2 * 9 // 16 and \
+                not tilted(mean):
+            return [cdiv(v * 16, N_LOG) for v in s] + [noise]
+    return None
+
+
+def tilt(samples, cal):
+    """Ticks at which each detector starts reporting an unstable turret"""
+    out = []
+    for name, t in (('fixed', Tilt()), ('calibrated', Tilt(cal))):
+        onsets = []
+        prev = False
+        for tick, o in enumerate(samples):
+            t.sample(o)
+            cur = t.unstable()
+            if cur and not prev:
+                onsets.append(tick)
+            prev = cur
+        out.append((name, onsets))
+    return out
+
+
+def main():
+    image = open(sys.argv[1], 'rb').read()
+    s = sessions(image)
+    if len(sys.argv) < 3:
+        for n, session in enumerate(reversed(s)):
+            ticks = sum(1 for e in decode(image, session) if e[0] == 'tick')
+            print('%d: %d sectors, %d ticks (%.1f s)%s' %
+                  (n + 1, len(session), ticks, ticks / 100.,
+                   '' if session[0][3] & FLAG_SESSION else ', partial'))
+        return
+    session = s[-int(sys.argv[2])]
+    if len(sys.argv) > 3 and sys.argv[3] == '--tilt':
+        samples = [e[3] for e in decode(image, session) if e[0] == 'tick']
+        cal = [int(v) for v in sys.argv[4].split(',')] \
+            if len(sys.argv) > 4 else \
+            recorded_cal(image, session) or calibrate(samples)
+        if not cal:
+            sys.exit('no quiet window to calibrate from')
+        print('rest %d,%d,%d (1/16 LSB), noise %d' % tuple(cal))
+        (_, fixed), (_, calibrated) = tilt(samples, cal)
+        print('fixed:      %s' % fixed)
+        print('calibrated: %s' % calibrated)
+        # pair every fixed onset with the nearest calibrated one before it
+        for f in fixed:
+            c = [t for t in calibrated if t <= f]
+            if c:
+                print('tick %d: calibrated %d ms earlier' %
+                      (f, (f - c[-1]) * 10))
+        return
+    print('tick,pir,end_switch,x,y,z,seed')
+    for e in decode(image, session):
+        if e[0] == 'seed':
+            print('%d,,,,,,%u' % (e[1], e[2]))
+        else:
+            print('%d,%d,%d,%d,%d,%d,' % ((e[1],) + e[2] + e[3]))
+
+
+if __name__ == '__main__':
+    main()
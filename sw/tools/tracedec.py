@@ -0,0 +1,124 @@
+#!/usr/bin/env python3
+#
+# Decode the output of the turret "trace" console command into Chrome
+# trace JSON (load in chrome://tracing or https://ui.perfetto.dev).
+#
+# Usage: tracedec.py console.log > trace.json
+
+import json
+import sys
+
+# Keep in sync with sw/main/trace.h and sw/main/behaviour.def
+EVENTS = [
+    'turret_state',
+    'stable_state',
+    'stream_open',
+    'stream_close',
+    'i2s_write',
+    'i2s_underrun',
+    'i2c',
+    'servo',
+]
+
+TURRET_STATES = ['stable', 'wobbly', 'unstable', 'fallen']
+STABLE_STATES = ['search', 'opening', 'firing', 'losing', 'lost',
+                 'about to close', 'closing']
+SERVOS = ['wingspan', 'wingturn']
+
+
+def parse(lines):
+    records = []
+    for line in lines:
+        f = line.split()
+        if len(f) < 3 or f[0] != 'TRC' or f[1] == 'end':
+            continue
+        core = int(f[1])
+        # header line: TRC <core> <head> <count>
+        if len(f) == 4 and len(f[2]) != 16:
+            continue
+        for r in f[2:]:
+            time = int(r[:8], 16)
+            word = int(r[8:], 16)
+            records.append((time, core, word >> 24, word & 0xffffff))
+    return records
+
+
+def unwrap(records):
+    # 32 bit microsecond timestamps wrap every ~71 minutes
+    records.sort()
+    if records and records[-1][0] - records[0][0] > 1 << 31:
+        records = [((t + (1 << 32)) if t < 1 << 31 else t, c, e, a)
+                   for t, c, e, a in records]
+        records.sort()
+    return records
+
+
+def head_tid(name, head):
+    # the first head keeps the single head names
+    return name if not head else '%s%d' % (name, head)
+
+
+def state_spans(out, records, event, names, tid):
+    prev = {}
+    for t, core, e, arg in records:
+        if e != event:
+            continue
+        head, state = arg >> 8, arg & 0xff
+        if head in prev:
+            p = prev[head]
+            out.append({'name': names[p[1]] if p[1] < len(names)
+                        else str(p[1]), 'ph': 'X', 'pid': 0,
+                        'tid': head_tid(tid, head), 'ts': p[0],
+                        'dur': t - p[0]})
+        prev[head] = (t, state)
+    for head, p in prev.items():
+        out.append({'name': names[p[1]] if p[1] < len(names)
+                    else str(p[1]), 'ph': 'i', 's': 't', 'pid': 0,
+                    'tid': head_tid(tid, head), 'ts': p[0]})
+
+
+def convert(records):
+    out = []
+    state_spans(out, records, EVENTS.index('turret_state'),
+                TURRET_STATES, 'turret')
+    state_spans(out, records, EVENTS.index('stable_state'),
+                STABLE_STATES, 'stable')
+    for t, core, e, arg in records:
+        name = EVENTS[e] if e < len(EVENTS) else 'event%d' % e
+        ev = {'name': name, 'pid': 0, 'tid': 'core%d' % core, 'ts': t}
+        if name in ('turret_state', 'stable_state'):
+            continue
+        elif name == 'stream_open':
+            ev.update({'ph': 'b', 'cat': 'stream', 'id': hex(arg),
+                       'name': 'stream'})
+        elif name == 'stream_close':
+            ev.update({'ph': 'e', 'cat': 'stream', 'id': hex(arg),
+                       'name': 'stream'})
+        elif name == 'servo':
+            servo = arg >> 16
+            ev.update({'ph': 'C',
+                       'name': head_tid(SERVOS[servo % len(SERVOS)],
+                                        servo // len(SERVOS)),
+                       'args': {'us': arg & 0xffff}})
+        elif name == 'i2c':
+            err = arg & 0xffff
+            ev.update({'ph': 'i', 's': 't',
+                       'args': {'reg': hex(arg >> 16),
+                                'err': err - 0x10000 if err & 0x8000
+                                else err}})
+        else:
+            ev.update({'ph': 'i', 's': 't', 'args': {'arg': arg}})
+        out.append(ev)
+    return out
+
+
+def main():
+    f = open(sys.argv[1]) if len(sys.argv) > 1 else sys.stdin
+    records = unwrap(parse(f))
+    json.dump({'traceEvents': convert(records),
+               'displayTimeUnit': 'ms'}, sys.stdout, indent=1)
+    sys.stdout.write('\n')
+
+
+if __name__ == '__main__':
+    main()